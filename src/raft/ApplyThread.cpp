@@ -0,0 +1,91 @@
+#include <assert.h>
+#include "raft/ApplyThread.h"
+
+namespace raft
+{
+
+ApplyThread::ApplyThread(const Applier& applier, std::size_t capacity, Index applied_idx)
+    : _applier(applier), _slots(capacity < 1 ? 1 : capacity), _head(0), _tail(0), _applied_idx(applied_idx), _pushed_idx(applied_idx)
+    , _waiting(false), _failed(false), _stop(false)
+{
+    _worker = std::thread([this]() { run(); });
+}
+
+ApplyThread::~ApplyThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _pushed.notify_one();
+    _worker.join();
+}
+
+bool ApplyThread::push(Index idx, const Entry& ety)
+{
+    if (full())
+        return false;
+    std::size_t tail = _tail.load();
+    Slot& slot = _slots[tail % _slots.size()];
+    slot.idx = idx;
+    slot.ety = ety;
+    _pushed_idx = idx;
+    _tail = tail + 1;
+
+    /* the worker announces that it is going to sleep before it checks the ring under the lock */
+    if (_waiting.load())
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pushed.notify_one();
+    }
+    return true;
+}
+
+bmcl::Option<Error> ApplyThread::get_error() const
+{
+    if (!_failed.load())
+        return bmcl::None;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error;
+}
+
+void ApplyThread::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _failed.load() || _applied_idx.load() >= _pushed_idx.load(); });
+}
+
+void ApplyThread::run()
+{
+    for (;;)
+    {
+        std::size_t head = _head.load();
+        if (head == _tail.load())
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle.notify_all();
+            _waiting = true;
+            _pushed.wait(lock, [this, head]() { return _stop.load() || head != _tail.load(); });
+            _waiting = false;
+            if (_stop)
+                return;
+            continue;
+        }
+
+        Slot& slot = _slots[head % _slots.size()];
+        bmcl::Option<Error> e = _applier(slot.idx, slot.ety.unwrap());
+        if (e.isSome())
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _error = e;
+            _failed = true;
+            _idle.notify_all();
+            return;
+        }
+        _applied_idx = slot.idx;
+        slot.ety.clear();
+        _head = head + 1;
+    }
+}
+
+}
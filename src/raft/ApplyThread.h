@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <bmcl/Option.h>
+#include "raft/Committer.h"
+
+namespace raft
+{
+
+/** Applies committed entries to the state machine on a thread of its own.
+ * The server thread pushes entries into a bounded single producer single consumer ring, the worker takes them
+ * in order and reports the last applied idx back through an atomic. The worker stops at the first error. */
+class ApplyThread
+{
+public:
+    ApplyThread(const Applier& applier, std::size_t capacity, Index applied_idx);
+    ~ApplyThread();
+    ApplyThread(const ApplyThread&) = delete;
+    ApplyThread& operator=(const ApplyThread&) = delete;
+
+    /** Called by the producer only. The entry is copied, its payload is shared. */
+    bool push(Index idx, const Entry& ety);
+    inline bool full() const { return _tail.load() - _head.load() >= _slots.size(); }
+    inline std::size_t capacity() const { return _slots.size(); }
+
+    /** highest idx the state machine has applied */
+    inline Index get_applied_idx() const { return _applied_idx.load(); }
+    /** error of the applier which stopped the worker */
+    bmcl::Option<Error> get_error() const;
+    /** Blocks until everything pushed is applied or the worker failed */
+    void wait_idle();
+
+private:
+    struct Slot
+    {
+        Index idx;
+        bmcl::Option<Entry> ety;
+    };
+
+    void run();
+
+    Applier                  _applier;
+    std::vector<Slot>        _slots;
+    std::atomic<std::size_t> _head;         /**< next slot to apply, written by the worker */
+    std::atomic<std::size_t> _tail;         /**< next slot to fill, written by the producer */
+    std::atomic<Index>       _applied_idx;
+    std::atomic<Index>       _pushed_idx;
+    std::atomic<bool>        _waiting;      /**< worker sleeps till the producer pushes */
+    std::atomic<bool>        _failed;
+    std::atomic<bool>        _stop;
+    bmcl::Option<Error>      _error;
+    mutable std::mutex       _mutex;
+    std::condition_variable  _pushed;
+    std::condition_variable  _idle;
+    std::thread              _worker;
+};
+
+}
@@ -0,0 +1,64 @@
+#include <string.h>
+#include "raft/Arena.h"
+
+namespace raft
+{
+
+Arena::Arena(std::size_t chunk_size)
+    : _chunk_size(chunk_size < 1 ? 1 : chunk_size), _used(0), _counters(std::make_shared<Counters>())
+{
+}
+
+std::shared_ptr<const uint8_t> Arena::new_chunk(std::size_t size)
+{
+    ++_counters->chunks_allocated;
+    std::shared_ptr<Counters> counters = _counters;
+    return std::shared_ptr<const uint8_t>(new uint8_t[size], [counters](const uint8_t* p)
+    {
+        delete[] p;
+        ++counters->chunks_released;
+    });
+}
+
+Buffer Arena::copy(const void* data, std::size_t size)
+{
+    if (size == 0)
+        return Buffer();
+
+    std::shared_ptr<const uint8_t> chunk;
+    std::size_t at = 0;
+    if (size > _chunk_size)
+    {
+        chunk = new_chunk(size);
+    }
+    else
+    {
+        if (!_chunk || _used + size > _chunk_size)
+        {
+            _chunk = new_chunk(_chunk_size);
+            _used = 0;
+        }
+        chunk = _chunk;
+        at = _used;
+        _used += size;
+    }
+
+    /* the chunk is written only here, before the bytes are shared */
+    uint8_t* dst = const_cast<uint8_t*>(chunk.get()) + at;
+    memcpy(dst, data, size);
+    ++_counters->allocations;
+    _counters->bytes += size;
+    return Buffer(chunk, dst, size);
+}
+
+Arena::Stats Arena::stats() const
+{
+    Stats s;
+    s.allocations = _counters->allocations;
+    s.bytes = _counters->bytes;
+    s.chunks_allocated = _counters->chunks_allocated;
+    s.chunks_released = _counters->chunks_released;
+    return s;
+}
+
+}
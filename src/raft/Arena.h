@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "raft/Buffer.h"
+
+namespace raft
+{
+
+/** Bump allocator for payloads. Bytes are carved one after another from chunks, a chunk is freed at once
+ * when no Buffer refers into it anymore. Log entries are allocated in log order, so dropping a prefix of the log
+ * releases whole chunks instead of many small blocks. */
+class Arena
+{
+public:
+    struct Stats
+    {
+        uint64_t allocations;               /**< payloads placed into chunks */
+        uint64_t bytes;                     /**< bytes of those payloads */
+        uint64_t chunks_allocated;
+        uint64_t chunks_released;
+    };
+
+    explicit Arena(std::size_t chunk_size = 64 * 1024);
+
+    /** Copy of the bytes kept in the current chunk, a payload larger than a chunk gets a chunk of its own */
+    Buffer copy(const void* data, std::size_t size);
+    Stats stats() const;
+    inline std::size_t chunk_size() const { return _chunk_size; }
+
+private:
+    struct Counters
+    {
+        Counters() : allocations(0), bytes(0), chunks_allocated(0), chunks_released(0) {}
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> chunks_allocated;
+        std::atomic<uint64_t> chunks_released; /**< chunks may be released by the last Buffer on any thread */
+    };
+
+    std::shared_ptr<const uint8_t> new_chunk(std::size_t size);
+
+    std::size_t _chunk_size;
+    std::shared_ptr<const uint8_t> _chunk;
+    std::size_t _used;
+    std::shared_ptr<Counters> _counters;
+};
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace raft
+{
+
+/** Immutable bytes shared by reference counting: copies of a Buffer point to the same memory,
+ * which is released together with the last of them. */
+class Buffer
+{
+public:
+    using Deleter = std::function<void(const uint8_t*)>;
+    using value_type = uint8_t;
+    using iterator = const uint8_t*;
+    using const_iterator = const uint8_t*;
+
+    Buffer() : _size(0) {}
+
+    /** copies the bytes */
+    Buffer(const void* buf, std::size_t len) : _size(0)
+    {
+        if (len == 0)
+            return;
+        uint8_t* p = new uint8_t[len];
+        memcpy(p, buf, len);
+        _ptr = std::shared_ptr<const uint8_t>(p, std::default_delete<const uint8_t[]>());
+        _size = len;
+    }
+
+    /** takes the bytes of the vector without copying them */
+    explicit Buffer(std::vector<uint8_t>&& data) : _size(data.size())
+    {
+        if (data.empty())
+            return;
+        auto v = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+        _ptr = std::shared_ptr<const uint8_t>(v, v->data());
+    }
+
+    /** adopts memory owned by the caller, deleter is called once the last Buffer referring to it is gone */
+    Buffer(const uint8_t* buf, std::size_t len, const Deleter& deleter) : _ptr(buf, deleter), _size(len) {}
+
+    /** points into a bigger block (e.g. a mapped file) and keeps the whole block alive */
+    Buffer(const std::shared_ptr<const uint8_t>& owner, const uint8_t* buf, std::size_t len) : _ptr(owner, buf), _size(len) {}
+
+    inline const uint8_t* data() const { return _ptr.get(); }
+    inline std::size_t size() const { return _size; }
+    inline bool empty() const { return _size == 0; }
+    inline const uint8_t* begin() const { return data(); }
+    inline const uint8_t* end() const { return data() + _size; }
+    inline uint8_t operator[](std::size_t i) const { return data()[i]; }
+    inline long use_count() const { return _ptr.use_count(); }
+    /** part of the bytes, shares them instead of copying */
+    inline Buffer slice(std::size_t offset, std::size_t len) const { return len == 0 ? Buffer() : Buffer(_ptr, data() + offset, len); }
+
+    inline bool operator==(const Buffer& other) const { return equals(other.data(), other.size()); }
+    inline bool operator!=(const Buffer& other) const { return !(*this == other); }
+    inline bool operator==(const std::vector<uint8_t>& other) const { return equals(other.data(), other.size()); }
+    inline bool operator!=(const std::vector<uint8_t>& other) const { return !(*this == other); }
+
+private:
+    inline bool equals(const uint8_t* other, std::size_t size) const
+    {
+        return _size == size && (_size == 0 || data() == other || memcmp(data(), other, _size) == 0);
+    }
+
+    std::shared_ptr<const uint8_t> _ptr;
+    std::size_t _size;
+};
+
+inline bool operator==(const std::vector<uint8_t>& l, const Buffer& r) { return r == l; }
+inline bool operator!=(const std::vector<uint8_t>& l, const Buffer& r) { return r != l; }
+
+}
@@ -0,0 +1,88 @@
+#include <assert.h>
+#include <string.h>
+#include "raft/Commands.h"
+
+namespace raft
+{
+
+static void put_u32(uint8_t* dst, uint32_t value)
+{
+    dst[0] = (uint8_t)value;
+    dst[1] = (uint8_t)(value >> 8);
+    dst[2] = (uint8_t)(value >> 16);
+    dst[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t get_u32(const uint8_t* src)
+{
+    return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+bmcl::Option<Error> CommandPacker::add(const void* data, std::size_t size)
+{
+    /* counts and offsets are u32, the whole payload has to fit them */
+    if (size > UINT32_MAX - sizeof(uint32_t) || this->size() > UINT32_MAX - sizeof(uint32_t) - size)
+        return Error::TooBig;
+
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    _bytes.insert(_bytes.end(), p, p + size);
+    _ends.push_back((uint32_t)_bytes.size());
+    return bmcl::None;
+}
+
+UserData CommandPacker::finish()
+{
+    std::vector<uint8_t> payload(size());
+    put_u32(payload.data(), (uint32_t)_ends.size());
+    for (std::size_t i = 0; i < _ends.size(); ++i)
+        put_u32(payload.data() + sizeof(uint32_t) * (1 + i), _ends[i]);
+    if (!_bytes.empty())
+        memcpy(payload.data() + sizeof(uint32_t) * (1 + _ends.size()), _bytes.data(), _bytes.size());
+    clear();
+    return UserData(std::move(payload));
+}
+
+void CommandPacker::clear()
+{
+    _ends.clear();
+    _bytes.clear();
+}
+
+bmcl::Option<PackedCommands> PackedCommands::parse(const UserData& data)
+{
+    const Buffer& b = data.data;
+    if (b.size() < sizeof(uint32_t))
+        return bmcl::None;
+    uint32_t count = get_u32(b.data());
+    if ((b.size() - sizeof(count)) / sizeof(uint32_t) < count)
+        return bmcl::None;
+
+    /* ends have to grow and stay within the bytes of the commands */
+    std::size_t bytes = b.size() - sizeof(uint32_t) * (1 + (std::size_t)count);
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t end = get_u32(b.data() + sizeof(uint32_t) * (1 + i));
+        if (end < prev || end > bytes)
+            return bmcl::None;
+        prev = end;
+    }
+    if (prev != bytes)
+        return bmcl::None;
+    return PackedCommands(b, count);
+}
+
+std::size_t PackedCommands::end_of(std::size_t i) const
+{
+    return get_u32(_data.data() + sizeof(uint32_t) * (1 + i));
+}
+
+Buffer PackedCommands::at(std::size_t i) const
+{
+    assert(i < _count);
+    std::size_t begin = i == 0 ? 0 : end_of(i - 1);
+    std::size_t base = sizeof(uint32_t) * (1 + _count);
+    return _data.slice(base + begin, end_of(i) - begin);
+}
+
+}
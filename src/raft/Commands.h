@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <bmcl/Option.h>
+#include "raft/Error.h"
+#include "raft/Ids.h"
+
+namespace raft
+{
+
+/** Builds the payload of a packed entry, which carries many small commands in one log entry.
+ * Layout: u32 count, u32 end offset of every command, bytes of the commands. Integers are little-endian,
+ * so nodes of any byte order read the same commands. */
+class CommandPacker
+{
+public:
+    /** Fails with TooBig if the payload would not fit in 4 GiB, the command isn't added then */
+    bmcl::Option<Error> add(const void* data, std::size_t size);
+    inline std::size_t count() const { return _ends.size(); }
+    /** size of the payload finish would return */
+    inline std::size_t size() const { return sizeof(uint32_t) * (1 + _ends.size()) + _bytes.size(); }
+    /** Payload of the commands added so far, the packer is empty afterwards */
+    UserData finish();
+    void clear();
+
+private:
+    std::vector<uint32_t> _ends;
+    std::vector<uint8_t>  _bytes;
+};
+
+/** Commands of a packed entry. They are read in place, a command shares the bytes of the entry. */
+class PackedCommands
+{
+public:
+    /** None if the payload isn't a well formed batch */
+    static bmcl::Option<PackedCommands> parse(const UserData& data);
+    inline std::size_t count() const { return _count; }
+    Buffer at(std::size_t i) const;
+
+private:
+    PackedCommands(const Buffer& data, std::size_t count) : _data(data), _count(count) {}
+    std::size_t end_of(std::size_t i) const;
+    Buffer      _data;
+    std::size_t _count;
+};
+
+}
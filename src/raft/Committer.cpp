@@ -6,6 +6,34 @@
 namespace raft
 {
 
+static bool is_cfg_change(const Entry& ety)
+{
+    return ety.isInternal() && ety.getInternalData()->type != InternalData::Noop;
+}
+
+Committer::Committer(IStorage* storage) : _storage(storage), _commit_idx(storage->get_base_idx()), _last_applied_idx(storage->get_base_idx())
+{
+    index_cfg_changes();
+}
+
+void Committer::index_cfg_changes()
+{
+    _cfg_change_idxs.clear();
+    for (Index idx = get_base_idx() + 1; idx <= get_current_idx(); ++idx)
+    {
+        if (is_cfg_change(get_at_idx(idx).unwrap()))
+            _cfg_change_idxs.push_back(idx);
+    }
+}
+
+void Committer::trim_cfg_changes()
+{
+    while (!_cfg_change_idxs.empty() && _cfg_change_idxs.front() <= get_base_idx())
+        _cfg_change_idxs.pop_front();
+    while (!_cfg_change_idxs.empty() && _cfg_change_idxs.back() > get_current_idx())
+        _cfg_change_idxs.pop_back();
+}
+
 void Committer::commit_till(Index idx)
 {
     if (is_committed(idx))
@@ -15,23 +43,62 @@ void Committer::commit_till(Index idx)
 }
 
 bmcl::Option<Error> Committer::entry_push_back(const Entry& ety, bool needVoteChecks)
+{
+    return entry_push_back(Entry(ety), needVoteChecks);
+}
+
+bmcl::Option<Error> Committer::entry_push_back(Entry&& ety, bool needVoteChecks)
 {
     /* Only one voting cfg change at a time */
     bool voting_change = ety.isInternal() && ety.getInternalData()->is_voting_cfg_change();
+    bool cfg_change = is_cfg_change(ety);
 
     if (needVoteChecks && voting_change && voting_change_is_in_progress())
         return Error::OneVotingChangeOnly;
 
-    bmcl::Option<Error> e = _storage->push_back(ety);
+    bmcl::Option<Error> e = _storage->push_back(std::move(ety));
     if (e.isSome())
         return e;
 
     if (voting_change)
         _voting_cfg_change_log_idx = get_current_idx();
+    if (cfg_change)
+        _cfg_change_idxs.push_back(get_current_idx());
 
     return bmcl::None;
 }
 
+bmcl::Option<Error> Committer::entry_append_range(const DataHandler& entries)
+{
+    Index first = get_current_idx() + 1;
+    bmcl::Option<Error> e = _storage->append_range(entries);
+
+    /* even on error some of the entries may be stored */
+    for (Index idx = first; idx <= get_current_idx(); ++idx)
+    {
+        const Entry& ety = get_at_idx(idx).unwrap();
+        if (is_cfg_change(ety))
+            _cfg_change_idxs.push_back(idx);
+        if (ety.isInternal() && ety.getInternalData()->is_voting_cfg_change())
+            _voting_cfg_change_log_idx = idx;
+    }
+    return e;
+}
+
+void Committer::recover()
+{
+    _voting_cfg_change_log_idx.clear();
+    index_cfg_changes();
+    for (auto i = _cfg_change_idxs.rbegin(); i != _cfg_change_idxs.rend(); ++i)
+    {
+        if (get_at_idx(*i)->getInternalData()->is_voting_cfg_change())
+        {
+            _voting_cfg_change_log_idx = *i;
+            break;
+        }
+    }
+}
+
 bmcl::Result<Entry, Error> Committer::entry_apply_one(const Applier& applier)
 {    /* Don't apply after the commit_idx */
     if (!has_not_applied())
@@ -64,32 +131,74 @@ void Committer::set_commit_idx(Index idx)
 
 bmcl::Option<TermId> Committer::get_last_log_term() const
 {
-    const auto& ety = _storage->back();
-    if (ety.isNone())
+    return _storage->get_term_at_idx(get_current_idx());
+}
+
+bmcl::Option<Error> Committer::compact(const UserData& data, const std::vector<SnapshotMember>& members)
+{
+    if (_last_applied_idx <= get_base_idx())
         return bmcl::None;
-    return ety->term();
+
+    Snapshot snapshot;
+    snapshot.last_idx = _last_applied_idx;
+    snapshot.last_term = get_term_at_idx(_last_applied_idx).unwrap();
+    snapshot.members = members;
+    snapshot.data = data;
+    bmcl::Option<Error> e = _storage->persist_snapshot(snapshot);
+    trim_cfg_changes();
+    return e;
 }
 
-bmcl::Option<Entry> Committer::entry_pop_back()
+bmcl::Result<Entry, Error> Committer::entry_pop_back()
 {
     Index idx = get_current_idx();
     if (_storage->empty() || idx <= get_commit_idx())
+        return Error::NothingToPop;
+
+    if (idx <= _voting_cfg_change_log_idx.unwrapOr(0))
+        _voting_cfg_change_log_idx.clear();
+
+    bmcl::Result<Entry, Error> r = _storage->pop_back();
+    trim_cfg_changes();
+    return r;
+}
+
+bmcl::Option<Error> Committer::entry_truncate_from(Index idx)
+{
+    idx = std::max(idx, get_commit_idx() + 1);
+    if (idx > get_current_idx())
         return bmcl::None;
 
     if (idx <= _voting_cfg_change_log_idx.unwrapOr(0))
         _voting_cfg_change_log_idx.clear();
 
-    return _storage->pop_back();
+    bmcl::Option<Error> e = _storage->truncate_from(idx);
+    trim_cfg_changes();
+    return e;
+}
+
+bmcl::Option<Error> Committer::install(const Snapshot& snapshot)
+{
+    bmcl::Option<Error> e = _storage->persist_snapshot(snapshot);
+    if (e.isSome())
+        return e;
+
+    _commit_idx = std::max(_commit_idx, snapshot.last_idx);
+    _last_applied_idx = std::max(_last_applied_idx, snapshot.last_idx);
+    if (_voting_cfg_change_log_idx.unwrapOr(0) <= snapshot.last_idx || _voting_cfg_change_log_idx.unwrapOr(0) > get_current_idx())
+        _voting_cfg_change_log_idx.clear();
+    trim_cfg_changes();
+    return bmcl::None;
 }
 
 EntryState Committer::entry_get_state(const MsgAddEntryRep& r) const
 {
-    bmcl::Option<const Entry&> ety = get_at_idx(r.idx);
-    if (ety.isNone())
+    bmcl::Option<TermId> term = get_term_at_idx(r.idx);
+    if (term.isNone())
         return EntryState::NotCommitted;
 
     /* entry from another leader has invalidated this entry message */
-    if (r.term != ety.unwrap().term())
+    if (r.term != term.unwrap())
         return EntryState::Invalidated;
     return is_committed(r.idx) ? EntryState::Committed : EntryState::NotCommitted;
 }
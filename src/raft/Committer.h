@@ -1,4 +1,5 @@
 #pragma once
+#include <deque>
 #include <functional>
 #include <bmcl/Option.h>
 #include <bmcl/Result.h>
@@ -9,6 +10,7 @@ namespace raft
 {
 
 using Applier = std::function<bmcl::Option<Error>(Index entry_idx, const Entry&)>;
+using SnapshotApplier = std::function<bmcl::Option<Error>(const Snapshot&)>;
 
 enum class EntryState : uint8_t
 {
@@ -20,19 +22,25 @@ enum class EntryState : uint8_t
 class Committer
 {
 public:
-    explicit Committer(IStorage* storage) : _storage(storage), _commit_idx(0), _last_applied_idx(0) {}
+    explicit Committer(IStorage* storage);
     const IStorage* storage() const { return _storage; }
     inline Index get_commit_idx() const { return _commit_idx; }
     inline Index get_last_applied_idx() const { return _last_applied_idx; }
     inline Index get_current_idx() const { return _storage->get_current_idx(); }
+    inline Index get_base_idx() const { return _storage->get_base_idx(); }
     bmcl::Option<const Entry&> get_at_idx(Index idx) const { return _storage->get_at_idx(idx); }
-    DataHandler get_from_idx(Index idx) const { return _storage->get_from_idx(idx); }
+    DataHandler get_from_idx(Index idx, Index max_count = Index(-1), std::size_t max_bytes = std::size_t(-1)) const { return _storage->get_from_idx(idx, max_count, max_bytes); }
 
     inline bool has_not_applied() const { return _last_applied_idx < get_commit_idx(); }
     inline bool is_committed(Index idx) const { return idx <= _commit_idx; }
     inline bool is_all_committed() const { return get_last_applied_idx() >= _commit_idx; }
     inline bool voting_change_is_in_progress() const { return _voting_cfg_change_log_idx.isSome(); }
+    /** Indexes of the entries in the log which change the configuration, in ascending order */
+    inline const std::deque<Index>& get_cfg_change_idxs() const { return _cfg_change_idxs; }
     bmcl::Option<TermId> get_last_log_term() const;
+    inline bmcl::Option<TermId> get_term_at_idx(Index idx) const { return _storage->get_term_at_idx(idx); }
+    inline Index get_first_idx_of_term(Index idx) const { return _storage->get_first_idx_of_term(idx); }
+    inline bmcl::Option<Index> get_last_idx_of_term(TermId term, Index max_idx) const { return _storage->get_last_idx_of_term(term, max_idx); }
     EntryState entry_get_state(const MsgAddEntryRep& r) const;
 
     void commit_till(Index idx);
@@ -40,14 +48,31 @@ public:
     void set_commit_idx(Index idx);
 
     bmcl::Option<Error> entry_push_back(const Entry& ety, bool needVoteChecks = false);
+    bmcl::Option<Error> entry_push_back(Entry&& ety, bool needVoteChecks = false);
+    /** Appends the entries received from the leader with one storage call */
+    bmcl::Option<Error> entry_append_range(const DataHandler& entries);
     bmcl::Result<Entry, Error> entry_apply_one(const Applier& applier);
-    bmcl::Option<Entry> entry_pop_back();
+    bmcl::Result<Entry, Error> entry_pop_back();
+    /** Drops the not committed entries starting at idx */
+    bmcl::Option<Error> entry_truncate_from(Index idx);
+    /** Picks up the log which the storage recovered, its last voting cfg change is in progress till it's applied */
+    void recover();
+
+    /** Replaces applied entries with the state machine image taken right after the last applied entry */
+    bmcl::Option<Error> compact(const UserData& data, const std::vector<SnapshotMember>& members);
+    /** Replaces the log up to snapshot.last_idx with the snapshot received from the leader */
+    bmcl::Option<Error> install(const Snapshot& snapshot);
 
 private:
+    void index_cfg_changes();
+    /** forgets the cfg changes which left the log */
+    void trim_cfg_changes();
+
     IStorage*   _storage;
     Index       _commit_idx;                           /**< idx of highest log entry known to be committed */
     Index       _last_applied_idx;                     /**< idx of highest log entry applied to state machine */
     bmcl::Option<Index> _voting_cfg_change_log_idx;    /**< the log which has a voting cfg change */
+    std::deque<Index> _cfg_change_idxs;
 };
 
 
@@ -0,0 +1,145 @@
+#include <string.h>
+#include "raft/Crc32c.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#   define RAFT_CRC32C_SSE42
+#   include <nmmintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#   endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#   define RAFT_CRC32C_ARMV8
+#   include <arm_acle.h>
+#endif
+
+namespace raft
+{
+
+/* reflected Castagnoli polynomial */
+static const uint32_t Poly = 0x82f63b78;
+
+namespace
+{
+/* slicing by 8: table[k][b] is the crc of byte b followed by k zero bytes */
+struct Tables
+{
+    Tables()
+    {
+        for (uint32_t b = 0; b < 256; ++b)
+        {
+            uint32_t crc = b;
+            for (int i = 0; i < 8; ++i)
+                crc = (crc >> 1) ^ (Poly & (0 - (crc & 1)));
+            table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; ++b)
+        {
+            for (int k = 1; k < 8; ++k)
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+    uint32_t table[8][256];
+};
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, std::size_t size)
+{
+    static const Tables tables;
+    const uint32_t (*t)[256] = tables.table;
+    while (size >= 8)
+    {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(RAFT_CRC32C_SSE42)
+
+#if defined(__GNUC__)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, std::size_t size)
+{
+    uint64_t c = crc;
+    while (size >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        size -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (size--)
+        c32 = _mm_crc32_u8(c32, *p++);
+    return c32;
+}
+
+static bool detect_hw()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#elif defined(RAFT_CRC32C_ARMV8)
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, std::size_t size)
+{
+    while (size >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+static bool detect_hw() { return true; }
+
+#endif
+
+bool crc32c_is_hardware()
+{
+#if defined(RAFT_CRC32C_SSE42) || defined(RAFT_CRC32C_ARMV8)
+    static const bool hw = detect_hw();
+    return hw;
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32c(const void* data, std::size_t size, uint32_t crc)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+#if defined(RAFT_CRC32C_SSE42) || defined(RAFT_CRC32C_ARMV8)
+    if (crc32c_is_hardware())
+        return ~crc32c_hw(crc, p, size);
+#endif
+    return ~crc32c_sw(crc, p, size);
+}
+
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace raft
+{
+
+/** CRC32C (Castagnoli) of the bytes, crc of the previous part continues the computation.
+ * Uses SSE4.2 or ARMv8 CRC instructions when the cpu has them, tables otherwise. */
+uint32_t crc32c(const void* data, std::size_t size, uint32_t crc = 0);
+
+/** true if crc32c runs on the cpu instructions */
+bool crc32c_is_hardware();
+
+}
@@ -9,9 +9,13 @@
 * @version 0.1
 */
 #pragma once
+#include <assert.h>
+#include <string.h>
+#include <new>
 #include <bmcl/Option.h>
-#include <bmcl/Either.h>
 #include "raft/Ids.h"
+#include "raft/Crc32c.h"
+#include "raft/Commands.h"
 
 namespace raft
 {
@@ -46,22 +50,107 @@ inline const char* to_string(InternalData::Type type)
     return "unknown";
 }
 
-/** Entry that is stored in the server's entry log. */
+/** Entry that is stored in the server's entry log.
+ * Header (term, id, checksum and kind) comes first and the payload is a handle to bytes kept out of line,
+ * an internal entry shares the place of the handle. */
 class Entry
 {
 private:
-    TermId _term;               /**< the entry's term at the point it was created */
-    EntryId _id;                 /**< the entry's unique ID */
-    bmcl::Either<InternalData, UserData> _data;
+    TermId   _term;             /**< the entry's term at the point it was created */
+    EntryId  _id;               /**< the entry's unique ID */
+    uint32_t _checksum;         /**< crc32c of the entry, set by the leader which created it */
+    bool     _has_checksum;
+    bool     _is_user;
+    bool     _is_packed;        /**< user payload is a batch of commands built by CommandPacker */
+    union
+    {
+        UserData     _user;
+        InternalData _internal;
+    };
+
+    void construct_data(const Entry& other)
+    {
+        if (_is_user)
+            new (&_user) UserData(other._user);
+        else
+            new (&_internal) InternalData(other._internal);
+    }
+    void construct_data(Entry&& other) noexcept
+    {
+        if (_is_user)
+            new (&_user) UserData(std::move(other._user));
+        else
+            new (&_internal) InternalData(other._internal);
+    }
+    void destroy_data() noexcept
+    {
+        if (_is_user)
+            _user.~UserData();
+    }
+
 public:
-    Entry(TermId term, EntryId id, UserData data) : _term(term), _id(id), _data(data) {}
-    Entry(TermId term, EntryId id, InternalData data) : _term(term), _id(id), _data(data) {}
-    bool isInternal() const { return _data.isFirst(); }
-    bool isUser() const { return _data.isSecond(); }
-    bmcl::Option<const InternalData&> getInternalData() const { return _data.unwrapFirst(); }
-    bmcl::Option<const UserData&> getUserData() const { return _data.unwrapSecond(); }
+    Entry(TermId term, EntryId id, UserData data) : _term(term), _id(id), _checksum(0), _has_checksum(false), _is_user(true), _is_packed(false) { new (&_user) UserData(std::move(data)); }
+    Entry(TermId term, EntryId id, InternalData data) : _term(term), _id(id), _checksum(0), _has_checksum(false), _is_user(false), _is_packed(false) { new (&_internal) InternalData(data); }
+    Entry(const Entry& other) : _term(other._term), _id(other._id), _checksum(other._checksum), _has_checksum(other._has_checksum), _is_user(other._is_user), _is_packed(other._is_packed) { construct_data(other); }
+    Entry(Entry&& other) noexcept : _term(other._term), _id(other._id), _checksum(other._checksum), _has_checksum(other._has_checksum), _is_user(other._is_user), _is_packed(other._is_packed) { construct_data(std::move(other)); }
+    ~Entry() { destroy_data(); }
+    /** the copy is made before the payload is replaced, so a failed copy leaves the entry as it was */
+    Entry& operator=(const Entry& other)
+    {
+        if (this == &other)
+            return *this;
+        Entry copy(other);
+        return *this = std::move(copy);
+    }
+    Entry& operator=(Entry&& other) noexcept
+    {
+        if (this == &other)
+            return *this;
+        destroy_data();
+        _term = other._term;
+        _id = other._id;
+        _checksum = other._checksum;
+        _has_checksum = other._has_checksum;
+        _is_user = other._is_user;
+        _is_packed = other._is_packed;
+        construct_data(std::move(other));
+        return *this;
+    }
+
+    bool isInternal() const { return !_is_user; }
+    bool isUser() const { return _is_user; }
+    bmcl::Option<const InternalData&> getInternalData() const { if (_is_user) return bmcl::None; return _internal; }
+    bmcl::Option<const UserData&> getUserData() const { if (!_is_user) return bmcl::None; return _user; }
+    bool is_packed() const { return _is_packed; }
+    /** Commands of a packed entry, read in place */
+    bmcl::Option<PackedCommands> get_commands() const { if (!_is_packed) return bmcl::None; return PackedCommands::parse(_user); }
     TermId  term() const { return _term; }
     EntryId id() const { return _id; }
+    /** Payload size, used to limit the size of replication messages */
+    std::size_t size() const { return _is_user ? _user.data.size() : sizeof(InternalData); }
+
+    bmcl::Option<uint32_t> checksum() const { if (!_has_checksum) return bmcl::None; return _checksum; }
+    void set_checksum(uint32_t crc) { _checksum = crc; _has_checksum = true; }
+    /** Stores the checksum of the current contents */
+    void seal() { set_checksum(compute_checksum()); }
+    /** false if the entry has a checksum which doesn't match its contents */
+    bool is_intact() const { return !_has_checksum || _checksum == compute_checksum(); }
+    /** crc32c of term, id, kind and node followed by the payload */
+    uint32_t compute_checksum() const
+    {
+        uint8_t h[25];
+        uint64_t term = _term;
+        uint64_t id = _id;
+        uint64_t node = _is_user ? 0 : (uint64_t)_internal.node;
+        memcpy(h, &term, 8);
+        memcpy(h + 8, &id, 8);
+        h[16] = _is_user ? (_is_packed ? 0xfe : 0xff) : (uint8_t)_internal.type;
+        memcpy(h + 17, &node, 8);
+        uint32_t crc = crc32c(h, sizeof(h));
+        if (_is_user)
+            crc = crc32c(_user.data.data(), _user.data.size(), crc);
+        return crc;
+    }
 
     static Entry add_node(TermId term, EntryId id, NodeId node) { return Entry(term, id, InternalData(InternalData::AddNode, node)); }
     static Entry remove_node(TermId term, EntryId id, NodeId node) { return Entry(term, id, InternalData(InternalData::RemoveNode, node)); }
@@ -69,6 +158,16 @@ public:
     static Entry add_nonvoting_node(TermId term, EntryId id, NodeId node) { return Entry(term, id, InternalData(InternalData::AddNonVotingNode, node)); }
     static Entry add_noop(TermId term, EntryId id) { return Entry(term, id, InternalData(InternalData::Noop, NodeId(0))); }
     static Entry user_empty(TermId term, EntryId id) { return Entry(term, id, UserData()); }
+    static Entry user_packed(TermId term, EntryId id, UserData commands) { Entry e(term, id, std::move(commands)); e._is_packed = true; return e; }
+
+    /** The same user entry, checksum included, with the payload kept in other bytes of the same contents */
+    Entry rebind(const Buffer& data) const
+    {
+        assert(_is_user && data.size() == _user.data.size());
+        Entry e(*this);
+        e._user.data = data;
+        return e;
+    }
 };
 
 }
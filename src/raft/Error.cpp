@@ -16,6 +16,11 @@ const char* to_string(Error e)
     case Error::NothingToApply: return "nothing to apply";
     case Error::NothingToSend: return "nothing to send";
     case Error::CantSendToMyself: return "cant send request to myself";
+    case Error::CantStore: return "cant write to persistent storage";
+    case Error::Corrupted: return "entry doesn't match its checksum";
+    case Error::TooManyVotingNodes: return "every voting slot is taken";
+    case Error::NothingToPop: return "no entry which can be removed";
+    case Error::TooBig: return "data doesn't fit its format";
     }
     return "unknown";
 }
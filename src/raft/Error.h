@@ -16,6 +16,11 @@ enum class Error : uint8_t
     NothingToSend,
     CantSendToMyself,
     CantSend,
+    CantStore,
+    Corrupted,
+    TooManyVotingNodes,
+    NothingToPop,
+    TooBig,
 };
 
 const char* to_string(Error e);
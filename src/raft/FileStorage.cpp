@@ -0,0 +1,956 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "raft/FileStorage.h"
+
+namespace raft
+{
+
+/* record: u32 payload size, u8 kind, u8 flags, 2 reserved bytes, u32 checksum, 4 reserved bytes,
+ * u64 term, u64 id, u64 node, payload. Integers are kept in host byte order */
+static const std::size_t RecordHeaderSize = 40;
+static const uint8_t UserRecord = 0xff;
+static const uint8_t PackedRecord = 0xfe;
+static const uint8_t HasChecksum = 0x01;
+static const char* SegmentSuffix = ".log";
+static const std::size_t SegmentNameSize = 20;
+
+static int sync_fd(int fd)
+{
+#if defined(__APPLE__)
+    return ::fsync(fd);
+#else
+    return ::fdatasync(fd);
+#endif
+}
+
+static bool write_all(int fd, const uint8_t* data, std::size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t r = ::pwrite(fd, data, size, (off_t)offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        data += r;
+        size -= (std::size_t)r;
+        offset += (uint64_t)r;
+    }
+    return true;
+}
+
+static bool read_all(int fd, uint8_t* data, std::size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t r = ::pread(fd, data, size, (off_t)offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        data += r;
+        size -= (std::size_t)r;
+        offset += (uint64_t)r;
+    }
+    return true;
+}
+
+template<typename T>
+static void put(uint8_t* dst, T value) { memcpy(dst, &value, sizeof(value)); }
+
+template<typename T>
+static T get(const uint8_t* src) { T value; memcpy(&value, src, sizeof(value)); return value; }
+
+static void encode(const Entry& ety, std::vector<uint8_t>* buf)
+{
+    const uint8_t* payload = nullptr;
+    std::size_t size = 0;
+    uint8_t kind = UserRecord;
+    uint64_t node = 0;
+    if (ety.isUser())
+    {
+        const UserData& data = ety.getUserData().unwrap();
+        if (ety.is_packed())
+            kind = PackedRecord;
+        payload = data.data.data();
+        size = data.data.size();
+    }
+    else
+    {
+        const InternalData& data = ety.getInternalData().unwrap();
+        kind = data.type;
+        node = (uint64_t)data.node;
+    }
+
+    std::size_t at = buf->size();
+    buf->resize(at + RecordHeaderSize + size);
+    uint8_t* h = buf->data() + at;
+    memset(h, 0, RecordHeaderSize);
+    put<uint32_t>(h, (uint32_t)size);
+    h[4] = kind;
+    if (ety.checksum().isSome())
+    {
+        h[5] = HasChecksum;
+        put<uint32_t>(h + 8, ety.checksum().unwrap());
+    }
+    put<uint64_t>(h + 16, (uint64_t)ety.term());
+    put<uint64_t>(h + 24, (uint64_t)ety.id());
+    put<uint64_t>(h + 32, node);
+    if (size)
+        memcpy(h + RecordHeaderSize, payload, size);
+}
+
+static Entry make_entry(Entry&& ety, const uint8_t* h)
+{
+    if (h[5] & HasChecksum)
+        ety.set_checksum(get<uint32_t>(h + 8));
+    return std::move(ety);
+}
+
+/** owner is the mapping the payload points into, payload is copied if there is none */
+static bmcl::Option<Entry> decode(const uint8_t* h, const uint8_t* payload, const std::shared_ptr<const uint8_t>& owner)
+{
+    uint32_t size = get<uint32_t>(h);
+    uint8_t kind = h[4];
+    TermId term = (TermId)get<uint64_t>(h + 16);
+    EntryId id = (EntryId)get<uint64_t>(h + 24);
+    NodeId node = NodeId(get<uint64_t>(h + 32));
+    bool user = kind == UserRecord || kind == PackedRecord;
+    if (!user && (kind > InternalData::Noop || size != 0))
+        return bmcl::None;
+
+    if (!user)
+        return make_entry(Entry(term, id, InternalData((InternalData::Type)kind, node)), h);
+    UserData data = (owner && size > 0) ? UserData(Buffer(owner, payload, size)) : UserData(payload, size);
+    if (kind == PackedRecord)
+        return make_entry(Entry::user_packed(term, id, std::move(data)), h);
+    return make_entry(Entry(term, id, std::move(data)), h);
+}
+
+static std::shared_ptr<const uint8_t> map_file(int fd, uint64_t size)
+{
+    if (size == 0)
+        return nullptr;
+    void* addr = ::mmap(nullptr, (std::size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    /* catch-up reads go through a segment from its start to end */
+    ::madvise(addr, (std::size_t)size, MADV_SEQUENTIAL);
+    return std::shared_ptr<const uint8_t>((const uint8_t*)addr, [size](const uint8_t* p) { ::munmap((void*)p, (std::size_t)size); });
+}
+
+FileStorage::FileStorage(const std::string& dir, std::size_t max_segment_size)
+    : _dir(dir), _max_segment_size(max_segment_size), _unsynced(0), _dir_dirty(false), _flush_running(false), _flusher_stop(false), _flush_failed(false), _durable_idx(0)
+{
+}
+
+FileStorage::~FileStorage()
+{
+    close();
+}
+
+void FileStorage::close()
+{
+    wait_flush();
+    stop_flusher();
+    for (const Segment& s : _segments)
+        ::close(s.fd);
+    _segments.clear();
+    _sealed_unsynced.clear();
+}
+
+std::string FileStorage::segment_path(Index first_idx) const
+{
+    char name[SegmentNameSize + 8];
+    snprintf(name, sizeof(name), "%020llu%s", (unsigned long long)first_idx, SegmentSuffix);
+    return _dir + "/" + name;
+}
+
+bmcl::Option<Error> FileStorage::open(std::size_t threads)
+{
+    close();
+    _recovered.clear();
+    bmcl::Option<Error> e = load_meta();
+    if (e.isSome())
+        return e;
+    e = load_snapshot();
+    if (e.isSome())
+        return e;
+
+    DIR* dir = ::opendir(_dir.c_str());
+    if (!dir)
+        return Error::CantStore;
+
+    std::vector<Index> firsts;
+    while (const dirent* i = ::readdir(dir))
+    {
+        std::size_t len = strlen(i->d_name);
+        if (len != SegmentNameSize + strlen(SegmentSuffix) || strcmp(i->d_name + SegmentNameSize, SegmentSuffix) != 0)
+            continue;
+        firsts.push_back((Index)strtoull(i->d_name, nullptr, 10));
+    }
+    ::closedir(dir);
+    std::sort(firsts.begin(), firsts.end());
+
+    for (Index first : firsts)
+    {
+        int fd = ::open(segment_path(first).c_str(), O_RDWR);
+        if (fd < 0)
+            return Error::CantStore;
+        _segments.emplace_back(first, fd);
+    }
+
+    /* segments are decoded and checked in parallel, they are independent of each other */
+    std::vector<LoadedSegment> loaded(_segments.size());
+    if (threads == 0)
+        threads = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+    threads = std::min(threads, _segments.size());
+    std::atomic<std::size_t> next_segment(0);
+    auto worker = [this, &loaded, &next_segment]()
+    {
+        for (std::size_t i = next_segment++; i < _segments.size(); i = next_segment++)
+            read_segment(_segments[i].fd, i + 1 < _segments.size(), &loaded[i]);
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for (std::thread& i : workers)
+        i.join();
+
+    /* a segment is sealed before its records are synced, so a crash after a rollover may leave a torn record or
+     * a gap in front of later segments. Nothing after it was acknowledged, the log ends there */
+    Index next = _mem.get_base_idx() + 1;
+    bool matches = true;
+    uint64_t truncated = 0;
+    std::size_t kept = 0;
+    for (; kept < _segments.size(); ++kept)
+    {
+        if ((kept == 0 && firsts[kept] > next) || (kept > 0 && firsts[kept] < next))
+            return Error::CantStore;
+        if (kept > 0 && firsts[kept] > next)
+            break;
+        truncated += loaded[kept].file_size - loaded[kept].size;
+        e = load_segment(_segments[kept], loaded[kept], &matches);
+        if (e.isSome())
+            return e;
+        next = firsts[kept] + _segments[kept].offsets.size();
+        if (_segments[kept].size != loaded[kept].file_size)
+        {
+            ++kept;
+            break;
+        }
+    }
+    for (std::size_t i = kept; i < _segments.size(); ++i)
+        truncated += loaded[i].file_size;
+    remove_segments(kept);
+
+    /* segments left by the snapshot which was installed over a conflicting log */
+    if (!matches)
+    {
+        remove_segments(0);
+        _mem.truncate_from(_mem.get_base_idx() + 1);
+        return finish_open(truncated);
+    }
+
+    /* segments covered by snapshot */
+    std::size_t covered = 0;
+    while (covered < _segments.size() && _segments[covered].first_idx + _segments[covered].offsets.size() <= _mem.get_base_idx() + 1)
+        ++covered;
+    if (covered == _segments.size() || _mem.empty())
+        remove_segments(0);
+    else
+        remove_segments(0, covered);
+    return finish_open(truncated);
+}
+
+bmcl::Option<Error> FileStorage::finish_open(uint64_t truncated_bytes)
+{
+    _durable_idx = _mem.get_current_idx();
+    if (_mem.get_current_idx() > 0)
+    {
+        RecoveredState state;
+        state.term = _mem.term();
+        state.vote = _mem.vote();
+        state.last_idx = _mem.get_current_idx();
+        state.segments = _segments.size();
+        state.truncated_bytes = truncated_bytes;
+        _recovered = state;
+    }
+    return sync_dir();
+}
+
+bmcl::Option<Error> FileStorage::load_snapshot()
+{
+    /* snapshot: u64 last idx, u64 last term, u64 members count, members (u64 id, u8 is voting), u64 data size, data */
+    int fd = ::open((_dir + "/snapshot").c_str(), O_RDONLY);
+    if (fd < 0 && errno == ENOENT)
+        return bmcl::None;
+    if (fd < 0)
+        return Error::CantStore;
+
+    struct stat st;
+    std::vector<uint8_t> data;
+    bool ok = ::fstat(fd, &st) == 0;
+    if (ok)
+    {
+        data.resize((std::size_t)st.st_size);
+        ok = read_all(fd, data.data(), data.size(), 0);
+    }
+    ::close(fd);
+    if (!ok || data.size() < 24)
+        return Error::CantStore;
+
+    Snapshot snapshot;
+    const uint8_t* p = data.data();
+    const uint8_t* end = p + data.size();
+    snapshot.last_idx = (Index)get<uint64_t>(p);
+    snapshot.last_term = (TermId)get<uint64_t>(p + 8);
+    uint64_t members = get<uint64_t>(p + 16);
+    p += 24;
+    /* the count comes from the disk, members * 9 may overflow */
+    if ((uint64_t)(end - p) < 8 || members > ((uint64_t)(end - p) - 8) / 9)
+        return Error::CantStore;
+    for (uint64_t i = 0; i < members; ++i, p += 9)
+        snapshot.members.emplace_back(NodeId(get<uint64_t>(p)), p[8] != 0);
+    uint64_t size = get<uint64_t>(p);
+    p += 8;
+    if ((uint64_t)(end - p) != size)
+        return Error::CantStore;
+    snapshot.data = UserData(p, (std::size_t)size);
+    return _mem.persist_snapshot(snapshot);
+}
+
+bmcl::Option<Error> FileStorage::persist_snapshot(const Snapshot& snapshot)
+{
+    if (snapshot.last_idx < _mem.get_base_idx())
+        return bmcl::None;
+
+    const Buffer& data = snapshot.data.data;
+    std::vector<uint8_t> buf(24 + snapshot.members.size() * 9 + 8 + data.size());
+    uint8_t* p = buf.data();
+    put<uint64_t>(p, (uint64_t)snapshot.last_idx);
+    put<uint64_t>(p + 8, (uint64_t)snapshot.last_term);
+    put<uint64_t>(p + 16, (uint64_t)snapshot.members.size());
+    p += 24;
+    for (const SnapshotMember& i : snapshot.members)
+    {
+        put<uint64_t>(p, (uint64_t)i.id);
+        p[8] = i.is_voting ? 1 : 0;
+        p += 9;
+    }
+    put<uint64_t>(p, (uint64_t)data.size());
+    if (!data.empty())
+        memcpy(p + 8, data.data(), data.size());
+
+    bmcl::Option<Error> e = write_file("snapshot", buf.data(), buf.size());
+    if (e.isSome())
+        return e;
+
+    e = _mem.persist_snapshot(snapshot);
+    if (e.isSome())
+        return e;
+
+    /* the log either is dropped entirely or keeps entries which follow the snapshot */
+    if (_mem.empty())
+    {
+        remove_segments(0);
+    }
+    else
+    {
+        std::size_t covered = 0;
+        while (covered + 1 < _segments.size() && _segments[covered + 1].first_idx <= snapshot.last_idx + 1)
+            ++covered;
+        remove_segments(0, covered);
+    }
+    if (_mem.empty() || _durable_idx < _mem.get_base_idx())
+        _durable_idx = _mem.get_base_idx();
+    return sync_dir();
+}
+
+void FileStorage::remove_segments(std::size_t from, std::size_t to)
+{
+    to = std::min(to, _segments.size());
+    if (from >= to)
+        return;
+
+    wait_flush();
+    for (std::size_t i = from; i < to; ++i)
+    {
+        const Segment& s = _segments[i];
+        ::close(s.fd);
+        ::unlink(segment_path(s.first_idx).c_str());
+        _sealed_unsynced.erase(std::remove(_sealed_unsynced.begin(), _sealed_unsynced.end(), s.fd), _sealed_unsynced.end());
+    }
+    _segments.erase(_segments.begin() + from, _segments.begin() + to);
+    _dir_dirty = true;
+}
+
+bmcl::Option<Error> FileStorage::write_file(const char* name, const uint8_t* data, std::size_t size)
+{
+    std::string tmp = _dir + "/" + name + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return Error::CantStore;
+    bool ok = write_all(fd, data, size, 0) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || ::rename(tmp.c_str(), (_dir + "/" + name).c_str()) != 0)
+        return Error::CantStore;
+
+    _dir_dirty = true;
+    return sync_dir();
+}
+
+bmcl::Option<Error> FileStorage::load_meta()
+{
+    /* meta: u64 term, u8 has vote, u64 vote */
+    int fd = ::open((_dir + "/meta").c_str(), O_RDONLY);
+    if (fd < 0 && errno == ENOENT)
+        return bmcl::None;
+    if (fd < 0)
+        return Error::CantStore;
+
+    uint8_t buf[17];
+    bool ok = read_all(fd, buf, sizeof(buf), 0);
+    ::close(fd);
+    if (!ok)
+        return Error::CantStore;
+
+    bmcl::Option<NodeId> vote;
+    if (buf[8])
+        vote = NodeId(get<uint64_t>(buf + 9));
+    return _mem.persist_term_vote((TermId)get<uint64_t>(buf), vote);
+}
+
+void FileStorage::read_segment(int fd, bool sealed, LoadedSegment* out)
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        out->failed = true;
+        return;
+    }
+    out->file_size = (uint64_t)st.st_size;
+
+    /* sealed segments are decoded straight from their mapping, the last one is read as it is still appended */
+    std::vector<uint8_t> buf;
+    const uint8_t* data = nullptr;
+    if (sealed)
+        out->map = map_file(fd, out->file_size);
+    if (out->map)
+    {
+        data = out->map.get();
+    }
+    else
+    {
+        buf.resize((std::size_t)out->file_size);
+        if (!read_all(fd, buf.data(), buf.size(), 0))
+        {
+            out->failed = true;
+            return;
+        }
+        data = buf.data();
+    }
+
+    /* a record is torn if it runs past the end of the file, or if the file was extended with zeros
+     * before the record reached the disk */
+    uint64_t offset = 0;
+    while (offset + RecordHeaderSize <= out->file_size)
+    {
+        const uint8_t* h = data + offset;
+        uint64_t end = offset + RecordHeaderSize + get<uint32_t>(h);
+        if (end > out->file_size)
+            break;
+        if (std::all_of(h, data + out->file_size, [](uint8_t b) { return b == 0; }))
+            break;
+        bmcl::Option<Entry> ety = decode(h, h + RecordHeaderSize, out->map);
+        if (ety.isNone())
+        {
+            out->failed = true;
+            return;
+        }
+        if (!ety->is_intact())
+        {
+            out->damaged = true;
+            break;
+        }
+        out->entries.emplace_back(std::move(ety.unwrap()));
+        out->offsets.push_back(offset);
+        offset = end;
+    }
+    out->size = offset;
+}
+
+bmcl::Option<Error> FileStorage::load_segment(Segment& s, LoadedSegment& loaded, bool* matches)
+{
+    if (loaded.failed)
+        return Error::CantStore;
+    /* a complete record may have been synced and acknowledged, it can't be dropped as torn */
+    if (loaded.damaged)
+        return Error::Corrupted;
+
+    for (std::size_t i = 0; i < loaded.entries.size(); ++i)
+    {
+        Index idx = s.first_idx + i;
+        if (idx > _mem.get_base_idx())
+            _mem.push_back(std::move(loaded.entries[i]));
+        else if (idx == _mem.get_base_idx() && loaded.entries[i].term() != _mem.get_base_term())
+            *matches = false;
+    }
+    s.offsets.swap(loaded.offsets);
+    s.size = loaded.size;
+    s.map = std::move(loaded.map);
+    s.map_size = s.map ? loaded.file_size : 0;
+    if (s.size == loaded.file_size)
+        return bmcl::None;
+
+    /* the torn segment becomes the last one and is appended again, it is mapped once it is sealed */
+    s.map.reset();
+    s.map_size = 0;
+    if (::ftruncate(s.fd, (off_t)s.size) != 0 || sync_fd(s.fd) != 0)
+        return Error::CantStore;
+    return bmcl::None;
+}
+
+bmcl::Option<Error> FileStorage::add_segment(Index first_idx)
+{
+    int fd = ::open(segment_path(first_idx).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return Error::CantStore;
+    if (!_segments.empty())
+    {
+        _sealed_unsynced.push_back(_segments.back().fd);
+        map_segment(_segments.back());
+    }
+    _segments.emplace_back(first_idx, fd);
+    _dir_dirty = true;
+    return bmcl::None;
+}
+
+void FileStorage::map_segment(Segment& s)
+{
+    std::shared_ptr<const uint8_t> map = map_file(s.fd, s.size);
+    if (!map)
+        return;
+
+    /* payloads leave the heap, the entries refer to the page cache instead */
+    for (std::size_t i = 0; i < s.offsets.size(); ++i)
+    {
+        Index idx = s.first_idx + i;
+        if (idx <= _mem.get_base_idx())
+            continue;
+        const Entry& ety = _mem.get_at_idx(idx).unwrap();
+        if (ety.isUser() && ety.size() > 0)
+            _mem.rebind_payload(idx, Buffer(map, map.get() + s.offsets[i] + RecordHeaderSize, ety.size()));
+    }
+    s.map = std::move(map);
+    s.map_size = s.size;
+}
+
+bmcl::Option<Error> FileStorage::cut_segment(Segment& s, std::size_t pos)
+{
+    uint64_t offset = pos < s.offsets.size() ? s.offsets[pos] : s.size;
+    if (!s.map)
+    {
+        if (::ftruncate(s.fd, (off_t)offset) != 0)
+            return Error::CantStore;
+    }
+    else
+    {
+        /* payloads which were handed out may still point into the mapping, cutting the file under it would make
+         * them fault. The kept records are written to a new file, the old one lives while it is mapped */
+        std::string path = segment_path(s.first_idx);
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return Error::CantStore;
+        uint64_t mapped = std::min(offset, s.map_size);
+        std::vector<uint8_t> rest((std::size_t)(offset - mapped));
+        bool ok = write_all(fd, s.map.get(), (std::size_t)mapped, 0)
+               && read_all(s.fd, rest.data(), rest.size(), mapped)
+               && write_all(fd, rest.data(), rest.size(), mapped)
+               && sync_fd(fd) == 0
+               && ::rename(tmp.c_str(), path.c_str()) == 0;
+        if (!ok)
+        {
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            return Error::CantStore;
+        }
+        _sealed_unsynced.erase(std::remove(_sealed_unsynced.begin(), _sealed_unsynced.end(), s.fd), _sealed_unsynced.end());
+        ::close(s.fd);
+        s.fd = fd;
+        s.map.reset();
+        s.map_size = 0;
+        _dir_dirty = true;
+    }
+    s.offsets.resize(pos);
+    s.size = offset;
+    return bmcl::None;
+}
+
+DataHandler FileStorage::get_from_idx(Index idx, Index max_count, std::size_t max_bytes) const
+{
+    DataHandler entries = _mem.get_from_idx(idx, max_count, max_bytes);
+    if (entries.count() == 0)
+        return entries;
+
+    /* entries of sealed segments may be evicted, ask for them to be read ahead of the copying */
+    static const uint64_t page = (uint64_t)::sysconf(_SC_PAGESIZE);
+    Index last = idx + entries.count() - 1;
+    auto i = std::upper_bound(_segments.begin(), _segments.end(), idx, [](Index idx, const Segment& s) { return idx < s.first_idx; });
+    for (i = i == _segments.begin() ? i : i - 1; i != _segments.end() && i->first_idx <= last; ++i)
+    {
+        if (!i->map || i->offsets.empty())
+            continue;
+        std::size_t from = idx > i->first_idx ? idx - i->first_idx : 0;
+        std::size_t to = std::min<std::size_t>(last - i->first_idx + 1, i->offsets.size());
+        if (from >= to)
+            continue;
+        uint64_t begin = i->offsets[from] / page * page;
+        uint64_t end = std::min(to < i->offsets.size() ? i->offsets[to] : i->size, i->map_size);
+        if (begin < end)
+            ::madvise((void*)(i->map.get() + begin), (std::size_t)(end - begin), MADV_WILLNEED);
+    }
+    return entries;
+}
+
+std::size_t FileStorage::mapped_count() const
+{
+    std::size_t count = 0;
+    for (const Segment& s : _segments)
+        count += s.map ? 1 : 0;
+    return count;
+}
+
+bmcl::Option<Error> FileStorage::push_back(const Entry& c)
+{
+    bmcl::Option<Error> e = write_record(c);
+    if (e.isSome())
+        return e;
+    return _mem.push_back(c);
+}
+
+bmcl::Option<Error> FileStorage::push_back(Entry&& c)
+{
+    bmcl::Option<Error> e = write_record(c);
+    if (e.isSome())
+        return e;
+    return _mem.push_back(std::move(c));
+}
+
+bmcl::Option<Error> FileStorage::append_range(const DataHandler& entries)
+{
+    assert(entries.prev_log_idx() == get_current_idx());
+    Index idx = entries.prev_log_idx() + 1;
+    Index last = entries.prev_log_idx() + entries.count();
+    while (idx <= last)
+    {
+        if (_segments.empty() || _segments.back().size >= _max_segment_size)
+        {
+            bmcl::Option<Error> e = add_segment(_mem.get_current_idx() + 1);
+            if (e.isSome())
+                return e;
+        }
+
+        /* records which fit into the active segment are written at once */
+        Segment& s = _segments.back();
+        std::size_t offsets = s.offsets.size();
+        Index first = idx;
+        _buf.clear();
+        for (; idx <= last && s.size + _buf.size() < _max_segment_size; ++idx)
+        {
+            s.offsets.push_back(s.size + _buf.size());
+            encode(entries.get_at_idx(idx).unwrap(), &_buf);
+        }
+
+        if (!write_all(s.fd, _buf.data(), _buf.size(), s.size))
+        {
+            int r = ::ftruncate(s.fd, (off_t)s.size);
+            (void)r;
+            s.offsets.resize(offsets);
+            return Error::CantStore;
+        }
+
+        s.size += _buf.size();
+        _unsynced += idx - first;
+        for (Index i = first; i < idx; ++i)
+            _mem.push_back(entries.get_at_idx(i).unwrap());
+    }
+    return bmcl::None;
+}
+
+bmcl::Option<Error> FileStorage::write_record(const Entry& c)
+{
+    if (_segments.empty() || _segments.back().size >= _max_segment_size)
+    {
+        bmcl::Option<Error> e = add_segment(_mem.get_current_idx() + 1);
+        if (e.isSome())
+            return e;
+    }
+
+    Segment& s = _segments.back();
+    _buf.clear();
+    encode(c, &_buf);
+    if (!write_all(s.fd, _buf.data(), _buf.size(), s.size))
+    {
+        /* drop partially written record, a segment left empty is reused by the next write */
+        int r = ::ftruncate(s.fd, (off_t)s.size);
+        (void)r;
+        return Error::CantStore;
+    }
+
+    s.offsets.push_back(s.size);
+    s.size += _buf.size();
+    ++_unsynced;
+    return bmcl::None;
+}
+
+bmcl::Result<Entry, Error> FileStorage::pop_back()
+{
+    if (_mem.empty())
+        return Error::NothingToPop;
+
+    wait_flush();
+    /* segment whose first record failed to be written holds nothing */
+    if (_segments.back().offsets.empty() && _segments.size() > 1)
+        remove_segments(_segments.size() - 1);
+    Segment& s = _segments.back();
+    assert(!s.offsets.empty());
+    bmcl::Option<Error> e = cut_segment(s, s.offsets.size() - 1);
+    if (e.isSome())
+        return e.unwrap();
+    ++_unsynced;
+    if (_durable_idx >= _mem.get_current_idx())
+        _durable_idx = _mem.get_current_idx() - 1;
+
+    if (s.offsets.empty() && _segments.size() > 1)
+        remove_segments(_segments.size() - 1);
+
+    return _mem.pop_back();
+}
+
+bmcl::Option<Error> FileStorage::truncate_from(Index idx)
+{
+    idx = std::max(idx, _mem.get_base_idx() + 1);
+    if (idx > _mem.get_current_idx())
+        return bmcl::None;
+
+    wait_flush();
+    if (_durable_idx >= idx)
+        _durable_idx = idx - 1;
+
+    std::size_t k = _segments.size() - 1;
+    while (k > 0 && _segments[k].first_idx > idx)
+        --k;
+    remove_segments(k + 1);
+
+    Segment& s = _segments[k];
+    std::size_t pos = idx - s.first_idx;
+    if (pos == 0 && k > 0)
+    {
+        remove_segments(k);
+    }
+    else
+    {
+        bmcl::Option<Error> e = cut_segment(s, pos);
+        if (e.isSome())
+            return e;
+    }
+
+    ++_unsynced;
+    return _mem.truncate_from(idx);
+}
+
+bmcl::Option<Error> FileStorage::sync()
+{
+    bmcl::Option<Error> e = wait_flush();
+    if (e.isSome())
+        return e;
+
+    for (int fd : _sealed_unsynced)
+    {
+        if (sync_fd(fd) != 0)
+            return Error::CantStore;
+    }
+    _sealed_unsynced.clear();
+
+    if (_unsynced > 0 && !_segments.empty())
+    {
+        if (sync_fd(_segments.back().fd) != 0)
+            return Error::CantStore;
+    }
+    _unsynced = 0;
+
+    if (_dir_dirty)
+    {
+        e = sync_dir();
+        if (e.isSome())
+            return e;
+    }
+    _durable_idx = _mem.get_current_idx();
+    return bmcl::None;
+}
+
+bmcl::Option<Error> FileStorage::flush()
+{
+    if (_flush_failed)
+        return wait_flush();
+
+    std::vector<int> fds;
+    fds.swap(_sealed_unsynced);
+    if (_unsynced > 0 && !_segments.empty())
+        fds.push_back(_segments.back().fd);
+    bool dir_dirty = _dir_dirty;
+    Index idx = _mem.get_current_idx();
+    _unsynced = 0;
+    _dir_dirty = false;
+
+    std::unique_lock<std::mutex> lock(_flush_mutex);
+    if (fds.empty() && !dir_dirty && !_flush_running && _flush_queued.isNone())
+    {
+        _durable_idx = idx;
+        return bmcl::None;
+    }
+
+    /* the flusher takes the queued request once the running one is done, later flushes join it */
+    if (_flush_queued.isNone())
+        _flush_queued = FlushRequest();
+    FlushRequest& req = _flush_queued.unwrap();
+    for (int fd : fds)
+    {
+        if (std::find(req.fds.begin(), req.fds.end(), fd) == req.fds.end())
+            req.fds.push_back(fd);
+    }
+    req.dir_dirty = req.dir_dirty || dir_dirty;
+    req.idx = idx;
+    if (!_flusher.joinable())
+    {
+        _flusher_stop = false;
+        _flusher = std::thread(&FileStorage::run_flusher, this);
+    }
+    lock.unlock();
+    _flush_cv.notify_all();
+    return bmcl::None;
+}
+
+void FileStorage::run_flusher()
+{
+    std::unique_lock<std::mutex> lock(_flush_mutex);
+    while (true)
+    {
+        _flush_cv.wait(lock, [this]() { return _flusher_stop || _flush_queued.isSome(); });
+        if (_flush_queued.isNone())
+            return;
+
+        FlushRequest req = std::move(_flush_queued.unwrap());
+        _flush_queued.clear();
+        _flush_running = true;
+        lock.unlock();
+
+        bool ok = true;
+        for (int fd : req.fds)
+            ok = ok && sync_fd(fd) == 0;
+        if (ok && req.dir_dirty)
+        {
+            int fd = ::open(_dir.c_str(), O_RDONLY);
+            ok = fd >= 0 && ::fsync(fd) == 0;
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+        lock.lock();
+        if (ok)
+            _durable_idx = req.idx;
+        else
+            _flush_failed = true;
+        _flush_running = false;
+        _flush_cv.notify_all();
+
+        /* the handler may flush again, so it is called without the lock */
+        DurableHandler handler = _durable_handler;
+        if (ok && handler)
+        {
+            lock.unlock();
+            handler(req.idx);
+            lock.lock();
+        }
+    }
+}
+
+void FileStorage::set_durable_handler(const DurableHandler& handler)
+{
+    std::lock_guard<std::mutex> lock(_flush_mutex);
+    _durable_handler = handler;
+}
+
+void FileStorage::stop_flusher()
+{
+    if (!_flusher.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_flush_mutex);
+        _flusher_stop = true;
+    }
+    _flush_cv.notify_all();
+    _flusher.join();
+}
+
+bmcl::Option<Error> FileStorage::wait_flush()
+{
+    {
+        std::unique_lock<std::mutex> lock(_flush_mutex);
+        _flush_cv.wait(lock, [this]() { return !_flush_running && _flush_queued.isNone(); });
+    }
+    if (!_flush_failed)
+        return bmcl::None;
+
+    /* unknown which of the records reached the disk, so everything is synced again by the next sync */
+    _flush_failed = false;
+    for (const Segment& s : _segments)
+        _sealed_unsynced.push_back(s.fd);
+    _unsynced = 1;
+    _dir_dirty = true;
+    return Error::CantStore;
+}
+
+Index FileStorage::get_durable_idx() const
+{
+    return std::min<Index>(_durable_idx, _mem.get_current_idx());
+}
+
+bmcl::Option<Error> FileStorage::sync_dir()
+{
+    int fd = ::open(_dir.c_str(), O_RDONLY);
+    if (fd < 0)
+        return Error::CantStore;
+    int r = ::fsync(fd);
+    ::close(fd);
+    if (r != 0)
+        return Error::CantStore;
+    _dir_dirty = false;
+    return bmcl::None;
+}
+
+bmcl::Option<Error> FileStorage::persist_term_vote(TermId term, bmcl::Option<NodeId> vote)
+{
+    uint8_t buf[17];
+    put<uint64_t>(buf, (uint64_t)term);
+    buf[8] = vote.isSome() ? 1 : 0;
+    put<uint64_t>(buf + 9, (uint64_t)vote.unwrapOr(NodeId(0)));
+
+    bmcl::Option<Error> e = write_file("meta", buf, sizeof(buf));
+    if (e.isSome())
+        return e;
+    return _mem.persist_term_vote(term, vote);
+}
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <bmcl/Option.h>
+#include "raft/Storage.h"
+
+namespace raft
+{
+
+/** Durable log kept in a directory of append-only segment files.
+ * Segment is named after the index of its first entry and holds records one after another,
+ * the offsets of its records are kept in memory to truncate the tail. Entries are mirrored in a MemStorage,
+ * so reads never touch the disk. Once a segment is sealed it is mapped read-only and payloads of its entries point
+ * into the mapping instead of the heap, so the kernel may evict them and read them back on demand.
+ * push_back only writes records, sync makes them durable with one fsync (group commit),
+ * flush hands the same fsync to a background flusher thread, get_durable_idx and the durable handler tell when it is done.
+ * Snapshot is kept in a separate file, segments fully covered by it are removed. */
+class FileStorage : public IStorage
+{
+public:
+    explicit FileStorage(const std::string& dir, std::size_t max_segment_size = 64 * 1024 * 1024);
+    ~FileStorage();
+
+    /** Loads term, vote and entries kept in the directory, the directory must exist.
+     * Segments are read and validated by up to threads workers (0 means one per core), then joined in order.
+     * The log is cut at the first record torn by a crash or at a gap between segments, later segments are removed. */
+    bmcl::Option<Error> open(std::size_t threads = 0);
+    void close();
+
+    TermId term() const override { return _mem.term(); }
+    bmcl::Option<NodeId> vote() const override { return _mem.vote(); }
+    bmcl::Option<Error> persist_term_vote(TermId term, bmcl::Option<NodeId> vote) override;
+
+    Index count() const override { return _mem.count(); }
+    bool empty() const override { return _mem.empty(); }
+    Index get_current_idx() const override { return _mem.get_current_idx(); }
+    bmcl::Option<const Entry&> get_at_idx(Index idx) const override { return _mem.get_at_idx(idx); }
+    /** Entries of sealed segments are prefetched from the mapping, the range is expected to be read sequentially */
+    DataHandler get_from_idx(Index idx, Index max_count, std::size_t max_bytes) const override;
+    bmcl::Option<const Entry&> back() const override { return _mem.back(); }
+
+    Index get_base_idx() const override { return _mem.get_base_idx(); }
+    TermId get_base_term() const override { return _mem.get_base_term(); }
+    bmcl::Option<const Snapshot&> get_snapshot() const override { return _mem.get_snapshot(); }
+    bmcl::Option<TermId> get_term_at_idx(Index idx) const override { return _mem.get_term_at_idx(idx); }
+    Index get_first_idx_of_term(Index idx) const override { return _mem.get_first_idx_of_term(idx); }
+    bmcl::Option<Index> get_last_idx_of_term(TermId term, Index max_idx) const override { return _mem.get_last_idx_of_term(term, max_idx); }
+    bmcl::Option<Error> persist_snapshot(const Snapshot& snapshot) override;
+
+    bmcl::Option<Error> push_back(const Entry& c) override;
+    bmcl::Option<Error> push_back(Entry&& c) override;
+    /** Records of the batch are written with one call per segment */
+    bmcl::Option<Error> append_range(const DataHandler& entries) override;
+    /** Cuts the segment holding idx and removes the ones after it */
+    bmcl::Option<Error> truncate_from(Index idx) override;
+    /** Fails with CantStore if the segment can't be cut, the entry stays in the log then */
+    bmcl::Result<Entry, Error> pop_back() override;
+    bmcl::Option<Error> sync() override;
+    /** Returns at once, records written so far are synced by the flusher thread.
+     * A flush which comes while the previous one runs is queued, the queued ones are merged and synced next */
+    bmcl::Option<Error> flush() override;
+    Index get_durable_idx() const override;
+    /** Called on the flusher thread after each flush which succeeded */
+    void set_durable_handler(const DurableHandler& handler) override;
+    /** Set by open if the directory had a log or a snapshot */
+    bmcl::Option<RecoveredState> get_recovered() const override { return _recovered; }
+
+    inline std::size_t segments_count() const { return _segments.size(); }
+    inline std::size_t unsynced_count() const { return _unsynced; }
+    std::size_t mapped_count() const;
+
+private:
+    struct Segment
+    {
+        Segment(Index first_idx, int fd) : first_idx(first_idx), fd(fd), size(0), map_size(0) {}
+        Index first_idx;                    /**< index of the first entry in segment */
+        int fd;
+        uint64_t size;                      /**< bytes written to the file */
+        std::vector<uint64_t> offsets;      /**< offset of each record in the file */
+        std::shared_ptr<const uint8_t> map; /**< read-only mapping of the sealed segment, entries keep it alive */
+        uint64_t map_size;
+    };
+
+    /** what the flusher syncs to make the log durable up to idx */
+    struct FlushRequest
+    {
+        FlushRequest() : dir_dirty(false), idx(0) {}
+        std::vector<int> fds;
+        bool dir_dirty;
+        Index idx;
+    };
+
+    /** records of a segment decoded by a recovery worker */
+    struct LoadedSegment
+    {
+        LoadedSegment() : size(0), file_size(0), damaged(false), failed(false) {}
+        std::shared_ptr<const uint8_t> map; /**< set if the sealed segment was decoded from its mapping */
+        std::vector<Entry> entries;
+        std::vector<uint64_t> offsets;
+        uint64_t size;                      /**< bytes taken by the complete records */
+        uint64_t file_size;
+        bool damaged;                       /**< a complete record doesn't match its checksum */
+        bool failed;
+    };
+
+    std::string segment_path(Index first_idx) const;
+    bmcl::Option<Error> load_meta();
+    bmcl::Option<Error> load_snapshot();
+    static void read_segment(int fd, bool sealed, LoadedSegment* out);
+    bmcl::Option<Error> load_segment(Segment& s, LoadedSegment& loaded, bool* matches);
+    bmcl::Option<Error> finish_open(uint64_t truncated_bytes);
+    bmcl::Option<Error> add_segment(Index first_idx);
+    bmcl::Option<Error> write_record(const Entry& c);
+    void map_segment(Segment& s);
+    /** drops the records of the segment starting at pos */
+    bmcl::Option<Error> cut_segment(Segment& s, std::size_t pos);
+    void remove_segments(std::size_t from, std::size_t to = std::size_t(-1));
+    bmcl::Option<Error> write_file(const char* name, const uint8_t* data, std::size_t size);
+    bmcl::Option<Error> sync_dir();
+    /** waits till the flusher is done with the queued flushes, files must not be cut or closed while it runs */
+    bmcl::Option<Error> wait_flush();
+    void run_flusher();
+    void stop_flusher();
+
+    std::string _dir;
+    std::size_t _max_segment_size;
+    std::vector<Segment> _segments;
+    std::vector<int> _sealed_unsynced;      /**< segments which were sealed after the last sync */
+    std::size_t _unsynced;                  /**< changes done to the log since the last sync */
+    bool _dir_dirty;
+    std::thread _flusher;                   /**< started by the first flush, runs till close */
+    std::mutex _flush_mutex;
+    std::condition_variable _flush_cv;
+    bmcl::Option<FlushRequest> _flush_queued;
+    bool _flush_running;
+    bool _flusher_stop;
+    DurableHandler _durable_handler;        /**< guarded by _flush_mutex */
+    std::atomic<bool> _flush_failed;
+    std::atomic<Index> _durable_idx;        /**< log is durable up to it, may be above the log after truncation */
+    bmcl::Option<RecoveredState> _recovered;
+    std::vector<uint8_t> _buf;
+    MemStorage _mem;
+};
+
+}
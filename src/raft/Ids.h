@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include "raft/Buffer.h"
 
 namespace raft
 {
@@ -10,12 +11,16 @@ using Index = std::size_t;
 using EntryId = std::size_t;
 using NodeCount = std::size_t;
 
+/** Payload of a user entry, copies of it share the same bytes */
 struct UserData
 {
     UserData() {}
-    UserData(const std::vector<uint8_t>& data) : data(data) {}
-    UserData(const void* buf, std::size_t len) : data((const uint8_t*)buf, (const uint8_t*)buf + len) { }
-    std::vector<uint8_t> data;
+    UserData(const std::vector<uint8_t>& data) : data(data.data(), data.size()) {}
+    UserData(std::vector<uint8_t>&& data) : data(std::move(data)) {}
+    UserData(const void* buf, std::size_t len) : data(buf, len) { }
+    UserData(const uint8_t* buf, std::size_t len, const Buffer::Deleter& deleter) : data(buf, len, deleter) { }
+    UserData(const Buffer& data) : data(data) {}
+    Buffer data;
 };
 
 }
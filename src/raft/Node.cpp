@@ -1,14 +1,207 @@
 #include <algorithm>
+#include <iterator>
 #include <assert.h>
 #include "raft/Node.h"
 
 namespace raft
 {
 
+void QuorumTracker::insert(Index idx)
+{
+    _quorum.insert(idx);
+    rebalance();
+}
+
+void QuorumTracker::erase(Index idx)
+{
+    auto i = _rest.find(idx);
+    if (i != _rest.end())
+    {
+        _rest.erase(i);
+    }
+    else
+    {
+        i = _quorum.find(idx);
+        if (i == _quorum.end())
+            return;
+        _quorum.erase(i);
+    }
+    rebalance();
+}
+
+void QuorumTracker::update(Index from, Index to)
+{
+    if (from == to)
+        return;
+    erase(from);
+    insert(to);
+}
+
+void QuorumTracker::clear()
+{
+    _quorum.clear();
+    _rest.clear();
+}
+
+void QuorumTracker::rebalance()
+{
+    /* quorum keeps the largest count / 2 + 1 indexes */
+    std::size_t size = count() / 2 + 1;
+    while (_quorum.size() > size)
+    {
+        _rest.insert(*_quorum.begin());
+        _quorum.erase(_quorum.begin());
+    }
+    while (_quorum.size() < size && !_rest.empty())
+    {
+        auto last = std::prev(_rest.end());
+        _quorum.insert(*last);
+        _rest.erase(last);
+    }
+    while (!_rest.empty() && *_quorum.begin() < *_rest.rbegin())
+    {
+        auto last = std::prev(_rest.end());
+        Index low = *_quorum.begin();
+        _quorum.erase(_quorum.begin());
+        _quorum.insert(*last);
+        _rest.erase(last);
+        _rest.insert(low);
+    }
+}
+
+static inline NodeCount popcount(uint64_t mask)
+{
+#if defined(__GNUC__)
+    return (NodeCount)__builtin_popcountll(mask);
+#else
+    NodeCount n = 0;
+    for (; mask != 0; mask &= mask - 1)
+        ++n;
+    return n;
+#endif
+}
+
+ReplicationState::ReplicationState() : _used(0), _voted(0), _me(0), _end(0)
+{
+    std::fill(std::begin(_match), std::end(_match), 0);
+}
+
+bmcl::Option<uint8_t> ReplicationState::insert(Index match_idx, bool voted_for_me, bool is_me)
+{
+    if (is_full())
+        return bmcl::None;
+    uint8_t slot = 0;
+    while (_used & ((uint64_t)1 << slot))
+        ++slot;
+    const uint64_t bit = (uint64_t)1 << slot;
+    _used |= bit;
+    if (voted_for_me)
+        _voted |= bit;
+    if (is_me)
+        _me |= bit;
+    _match[slot] = match_idx;
+    if (slot >= _end)
+        _end = slot + 1;
+    _quorum.insert(match_idx);
+    return slot;
+}
+
+void ReplicationState::erase(uint8_t slot)
+{
+    const uint64_t bit = (uint64_t)1 << slot;
+    assert(_used & bit);
+    _quorum.erase(_match[slot]);
+    _match[slot] = 0;
+    _used &= ~bit;
+    _voted &= ~bit;
+    _me &= ~bit;
+    while (_end > 0 && !(_used & ((uint64_t)1 << (_end - 1))))
+        --_end;
+}
+
+void ReplicationState::set_match_idx(uint8_t slot, Index idx)
+{
+    _quorum.update(_match[slot], idx);
+    _match[slot] = idx;
+}
+
+void ReplicationState::set_vote(uint8_t slot, bool vote)
+{
+    const uint64_t bit = (uint64_t)1 << slot;
+    if (vote)
+        _voted |= bit;
+    else
+        _voted &= ~bit;
+}
+
+NodeCount ReplicationState::count() const
+{
+    return popcount(_used);
+}
+
+NodeCount ReplicationState::get_nvotes_for_me() const
+{
+    return popcount(_voted & ~_me);
+}
+
+bool ReplicationState::is_committed(Index idx) const
+{
+    if (_used == 0)
+        return false;
+    if (idx == 0)
+        return true;
+    /* free slots hold 0 and never match, the loop has no branches and is vectorized */
+    NodeCount matched = 0;
+    for (uint8_t i = 0; i < _end; ++i)
+        matched += (NodeCount)(_match[i] >= idx);
+    return matched > count() / 2;
+}
+
+void ReplicationState::clear()
+{
+    std::fill(std::begin(_match), std::end(_match), 0);
+    _used = 0;
+    _voted = 0;
+    _me = 0;
+    _end = 0;
+    _quorum.clear();
+}
+
 Nodes::Nodes(NodeId id) : _me(id)
 {
 }
 
+Nodes::Nodes(const Nodes& other) : _me(other._me), _nodes(other._nodes)
+{
+    rebuild_index();
+}
+
+Nodes& Nodes::operator=(const Nodes& other)
+{
+    _me = other._me;
+    _nodes = other._nodes;
+    rebuild_index();
+    return *this;
+}
+
+void Nodes::rebuild_index()
+{
+    _index.clear();
+    _state.clear();
+    for (auto i = _nodes.begin(); i != _nodes.end(); ++i)
+    {
+        _index.emplace(i->get_id(), i);
+        i->_state = &_state;
+        if (!i->is_voting())
+            continue;
+        bmcl::Option<uint8_t> slot = _state.insert(i->get_match_idx(), i->has_vote_for_me(), i->is_me());
+        if (slot.isSome())
+            i->_slot = slot.unwrap();
+        else
+            i->_flags.set(Node::NodeVoting, false);
+    }
+}
+
 void Nodes::reset_all_votes()
 {
     for (auto& i : _nodes)
@@ -30,18 +223,18 @@ void Nodes::set_all_need_pings(bool need)
 
 bmcl::Option<const Node&> Nodes::get_node(NodeId id) const
 {
-    const auto& i = std::find_if(_nodes.begin(), _nodes.end(), [id](const Node& i) {return i.get_id() == id; });
-    if (i == _nodes.end())
+    const auto i = _index.find(id);
+    if (i == _index.end())
         return bmcl::None;
-    return *i;
+    return *i->second;
 }
 
 bmcl::Option<Node&> Nodes::get_node(NodeId id)
 {
-    const auto& i = std::find_if(_nodes.begin(), _nodes.end(), [id](const Node& i) {return i.get_id() == id; });
-    if (i == _nodes.end())
+    const auto i = _index.find(id);
+    if (i == _index.end())
         return bmcl::None;
-    return *i;
+    return *i->second;
 }
 
 bmcl::Option<const Node&> Nodes::get_my_node() const
@@ -59,10 +252,13 @@ Node& Nodes::add_node(NodeId id, bool is_voting)
         return node.unwrap();
     }
     assert(std::numeric_limits<NodeCount>::max() >= _nodes.size());
-    _nodes.emplace_back(Node(id, is_me(id)));
-    _nodes.back().set_voting(is_voting);
-    std::sort(_nodes.begin(), _nodes.end(), [](const Node& l, const Node& r) { return l.get_id() < r.get_id(); });
-    return *std::find_if(_nodes.begin(), _nodes.end(), [id](const Node& n) { return n.get_id() == id; });
+    const auto pos = std::find_if(_nodes.begin(), _nodes.end(), [id](const Node& n) { return id < n.get_id(); });
+    const auto i = _nodes.emplace(pos, Node(id, is_me(id)));
+    _index.emplace(id, i);
+    i->set_voting(false);
+    i->_state = &_state;
+    i->set_voting(is_voting);
+    return *i;
 }
 
 Node& Nodes::add_my_node(bool is_voting)
@@ -72,14 +268,17 @@ Node& Nodes::add_my_node(bool is_voting)
 
 void Nodes::remove_node(NodeId id)
 {
-    const auto i = std::find_if(_nodes.begin(), _nodes.end(), [id](const Node& i) {return i.get_id() == id; });
-    if (i != _nodes.end())
-        _nodes.erase(i);
+    const auto i = _index.find(id);
+    if (i == _index.end())
+        return;
+    i->second->set_voting(false);
+    _nodes.erase(i->second);
+    _index.erase(i);
 }
 
 NodeCount Nodes::get_nvotes_for_me(bmcl::Option<NodeId> voted_for) const
 {
-    NodeCount votes = (NodeCount)std::count_if(_nodes.begin(), _nodes.end(), [](const Node& i) { return !i.is_me() && i.is_voting() && i.has_vote_for_me(); });
+    NodeCount votes = _state.get_nvotes_for_me();
 
     if (voted_for == _me)
         votes += 1;
@@ -89,7 +288,7 @@ NodeCount Nodes::get_nvotes_for_me(bmcl::Option<NodeId> voted_for) const
 
 NodeCount Nodes::get_num_voting_nodes() const
 {
-    return (NodeCount)std::count_if(_nodes.begin(), _nodes.end(), [](const Node& i) { return i.is_voting(); });
+    return _state.count();
 }
 
 bool Nodes::votes_has_majority(bmcl::Option<NodeId> voted_for) const
@@ -106,8 +305,7 @@ bool Nodes::votes_has_majority(NodeCount num_nodes, NodeCount nvotes)
 
 bool Nodes::is_committed(Index idx) const
 {
-    NodeCount votes = (NodeCount)std::count_if(_nodes.begin(), _nodes.end(), [idx](const Node& i) { return i.is_voting() && idx <= i.get_match_idx(); });
-    return (get_num_voting_nodes() / 2 < votes);
+    return _state.is_committed(idx);
 }
 
 bool Nodes::is_me_the_only_voting() const
@@ -10,14 +10,69 @@
  */
 #pragma once
 #include <bitset>
+#include <deque>
+#include <list>
+#include <set>
+#include <unordered_map>
 #include <bmcl/ArrayView.h>
 #include "raft/Types.h"
 
 namespace raft
 {
 
+/** Match indexes of the voting nodes split into the quorum (the largest majority of them) and the rest.
+ * The highest idx stored on a majority is the smallest one of the quorum, every update is O(log n). */
+class QuorumTracker
+{
+public:
+    void insert(Index idx);
+    void erase(Index idx);
+    void update(Index from, Index to);
+    inline NodeCount count() const { return (NodeCount)(_quorum.size() + _rest.size()); }
+    /** highest idx which is matched by a majority of voting nodes, 0 if there are none */
+    inline Index get_quorum_idx() const { return _quorum.empty() ? 0 : *_quorum.begin(); }
+    void clear();
+
+private:
+    void rebalance();
+    std::multiset<Index> _quorum;
+    std::multiset<Index> _rest;
+};
+
+/** Replication state of the voting nodes laid out as arrays: every voting node owns a slot holding its match idx,
+ * votes and membership are bits of masks. Vote counts are popcounts and commit checks are plain compares over
+ * contiguous indexes instead of walks over the node list. Capacity is bounded by the width of the masks,
+ * a node which is to become voting while every slot is taken stays non-voting. */
+class ReplicationState
+{
+public:
+    enum { Capacity = 64 };
+    ReplicationState();
+    /** takes the lowest free slot for a node becoming voting, None if every slot is taken */
+    bmcl::Option<uint8_t> insert(Index match_idx, bool voted_for_me, bool is_me);
+    void erase(uint8_t slot);
+    void set_match_idx(uint8_t slot, Index idx);
+    void set_vote(uint8_t slot, bool vote);
+    NodeCount count() const;
+    inline bool is_full() const { return ~_used == 0; }
+    /** votes granted by the voting nodes other than me */
+    NodeCount get_nvotes_for_me() const;
+    bool is_committed(Index idx) const;
+    inline Index get_quorum_idx() const { return _quorum.get_quorum_idx(); }
+    void clear();
+
+private:
+    Index           _match[Capacity];   /**< match idx per slot, 0 in free slots */
+    uint64_t        _used;
+    uint64_t        _voted;
+    uint64_t        _me;
+    uint8_t         _end;               /**< slots past it are free */
+    QuorumTracker   _quorum;
+};
+
 class Node
 {
+    friend class Nodes;
     enum BitFlags
     {
         VotedForMe              = 0,
@@ -28,11 +83,23 @@ class Node
     };
 
 public:
-    inline explicit Node(NodeId id, bool is_me) : _id(id), _next_idx(1),  _match_idx(0), _last_cfg_seen_idx(0), _flags(0)
+    inline explicit Node(NodeId id, bool is_me) : _id(id), _next_idx(1),  _match_idx(0), _last_cfg_seen_idx(0), _snapshot_idx(0), _snapshot_offset(0), _stale_rejects(0), _state(nullptr), _slot(0), _flags(0)
     {
         _flags.set(NodeVoting, true);
         _flags.set(IsMe, is_me);
     }
+    /** A copy is detached from the replication state of the Nodes the original belongs to, only Nodes attaches it */
+    inline Node(const Node& other) : _state(nullptr) { copy(other); }
+    inline Node& operator=(const Node& other)
+    {
+        if (this == &other)
+            return *this;
+        if (_state && is_voting())
+            _state->erase(_slot);
+        _state = nullptr;
+        copy(other);
+        return *this;
+    }
 
     inline NodeId get_id() const { return _id; }
     inline bool is_me() const { return _flags.test(IsMe); }
@@ -41,15 +108,70 @@ public:
     inline void set_next_idx(Index idx) {/* log index begins at 1 */ _next_idx = idx < 1 ? 1 : idx; }
 
     inline Index get_match_idx() const { return _match_idx; }
-    inline void set_match_idx(Index idx) { _match_idx = idx; }
+    inline void set_match_idx(Index idx)
+    {
+        if (_state && is_voting())
+            _state->set_match_idx(_slot, idx);
+        _match_idx = idx;
+    }
 
     inline Index get_last_cfg_seen_idx() const { return _last_cfg_seen_idx; }
     inline void set_last_cfg_seen_idx(Index idx) { _last_cfg_seen_idx = idx; }
 
+    /** snapshot being sent to the node and the offset the node expects next */
+    inline Index get_snapshot_idx() const { return _snapshot_idx; }
+    inline std::size_t get_snapshot_offset() const { return _snapshot_offset; }
+    inline void set_snapshot_progress(Index idx, std::size_t offset) { _snapshot_idx = idx; _snapshot_offset = offset; }
+
+    /** AppendEntries with entries sent to the node optimistically and not acknowledged yet, kept by their last idx */
+    inline std::size_t get_inflight_count() const { return _inflight.size(); }
+    inline void add_inflight(Index last_idx) { _inflight.push_back(last_idx); }
+    /** releases the batches covered by idx the node acknowledged */
+    inline void ack_inflight(Index idx)
+    {
+        while (!_inflight.empty() && _inflight.front() <= idx)
+            _inflight.pop_front();
+        _stale_rejects = 0;
+    }
+    /** forgets the batches in flight, count of them will be rejected as they followed a rejected one */
+    inline void reset_inflight(std::size_t stale_rejects = 0) { _inflight.clear(); _stale_rejects = stale_rejects; }
+    /** true if a rejection is expected to be of a batch which was sent before the window was reset */
+    inline bool take_stale_reject()
+    {
+        if (_stale_rejects == 0)
+            return false;
+        --_stale_rejects;
+        return true;
+    }
+
     inline bool has_vote_for_me() const { return _flags.test(VotedForMe); }
-    inline void vote_for_me(bool vote) { _flags.set(VotedForMe, vote); }
+    inline void vote_for_me(bool vote)
+    {
+        if (_state && is_voting())
+            _state->set_vote(_slot, vote);
+        _flags.set(VotedForMe, vote);
+    }
 
-    inline void set_voting(bool voting) { _flags.set(NodeVoting, voting); }
+    /** false if the node can't become voting as every voting slot of its Nodes is taken */
+    inline bool set_voting(bool voting)
+    {
+        if (_state && voting != is_voting())
+        {
+            if (voting)
+            {
+                bmcl::Option<uint8_t> slot = _state->insert(_match_idx, has_vote_for_me(), is_me());
+                if (slot.isNone())
+                    return false;
+                _slot = slot.unwrap();
+            }
+            else
+            {
+                _state->erase(_slot);
+            }
+        }
+        _flags.set(NodeVoting, voting);
+        return true;
+    }
     inline bool is_voting() const { return _flags.test(NodeVoting); }
 
     inline void set_need_vote_req(bool need) { _flags.set(NeedVoteReq, need); }
@@ -59,18 +181,47 @@ public:
     inline bool need_append_endtries_req() const { return _flags.test(NeedAppendEntriesReq); }
 
 private:
+    inline void copy(const Node& other)
+    {
+        _id = other._id;
+        _next_idx = other._next_idx;
+        _match_idx = other._match_idx;
+        _last_cfg_seen_idx = other._last_cfg_seen_idx;
+        _snapshot_idx = other._snapshot_idx;
+        _snapshot_offset = other._snapshot_offset;
+        _inflight = other._inflight;
+        _stale_rejects = other._stale_rejects;
+        _slot = other._slot;
+        _flags = other._flags;
+    }
+
     NodeId          _id;
     Index           _next_idx;
     Index           _match_idx;
     Index           _last_cfg_seen_idx;
+    Index           _snapshot_idx;
+    std::size_t     _snapshot_offset;
+    std::deque<Index> _inflight;
+    std::size_t     _stale_rejects;
+    ReplicationState* _state;       /**< replication state of the Nodes the node belongs to */
+    uint8_t         _slot;          /**< slot in _state while the node is voting */
     std::bitset<8>  _flags;
 };
 
+struct NodeIdHash
+{
+    inline std::size_t operator()(NodeId id) const { return std::hash<std::size_t>()((std::size_t)id); }
+};
+
+/** Nodes are kept sorted by id in a list, so references to them stay valid until the node is removed.
+ * Lookups by id go through a hash index. */
 class Nodes
 {
 public:
-    using Items = std::vector<Node>;
+    using Items = std::list<Node>;
     Nodes(NodeId id);
+    Nodes(const Nodes& other);
+    Nodes& operator=(const Nodes& other);
     inline NodeCount count() const { return (NodeCount)_nodes.size(); }
     inline const Items& items() const { return _nodes; }
     inline NodeId get_my_id() const { return _me; }
@@ -81,6 +232,7 @@ public:
     bmcl::Option<const Node&> get_node(NodeId id) const;
     bmcl::Option<Node&> get_node(NodeId id);
     bmcl::Option<const Node&> get_my_node() const;
+    /** Node which is to be voting is added as non-voting if there is no free voting slot */
     Node& add_node(NodeId id, bool is_voting);
     Node& add_my_node(bool is_voting);
     void remove_node(NodeId id);
@@ -88,12 +240,17 @@ public:
     bool is_me_candidate_ready() const;
     NodeCount get_nvotes_for_me(bmcl::Option<NodeId> voted_for) const;
     NodeCount get_num_voting_nodes() const;
+    inline bool has_free_voting_slot() const { return !_state.is_full(); }
     bool votes_has_majority(bmcl::Option<NodeId> voted_for) const;
     static bool votes_has_majority(NodeCount num_nodes, NodeCount nvotes);
     bool is_committed(Index idx) const;
+    inline Index get_quorum_idx() const { return _state.get_quorum_idx(); }
 private:
+    void rebuild_index();
     NodeId _me;
     Items  _nodes;
+    std::unordered_map<NodeId, Items::iterator, NodeIdHash> _index;
+    ReplicationState _state;
 };
 
 
@@ -9,6 +9,7 @@
  */
 
 #include <assert.h>
+#include <algorithm>
 
 #include "raft/Raft.h"
 
@@ -31,14 +32,21 @@ const char* to_string(State s)
 }
 
 Server::Server(NodeId id, bool isNewCluster, const Applier& applyer, IStorage* storage, ISender* sender, IEventHandler* events)
-    : _last_cfg_seen(0), _nodes(id), _storage(storage), _committer(storage), _applier(applyer), _sender(sender), _events(&_defaultEventsHandler)
+    : _last_cfg_seen(0), _snapshot_chunk_size(64 * 1024), _max_entries_per_append(4096), _max_bytes_per_append(1024 * 1024), _max_inflight_appends(1), _entry_checksums(false), _entry_poped_events(false), _batch_max_count(1), _batch_max_bytes(std::size_t(-1)), _batch_max_delay(0), _batch_first_idx(0), _batch_count(0), _batch_bytes(0), _batch_age(0), _nodes(id), _storage(storage), _committer(storage), _applier(applyer), _sender(sender), _events(&_defaultEventsHandler)
 {
     set_event_handler(events);
     _current_term = _storage->term();
     _voted_for = _storage->vote();
-    if (isNewCluster)
+    if (recover())
+    {
+        /* a single voting member becomes the leader again at once */
+        become_follower();
+        tick();
+    }
+    else if (isNewCluster)
     {
         entry_push(Entry::add_node(_current_term, 0, id), false);
+        _storage->sync();
         become_candidate();
         tick();
         assert(is_leader());
@@ -50,15 +58,21 @@ Server::Server(NodeId id, bool isNewCluster, const Applier& applyer, IStorage* s
 }
 
 Server::Server(NodeId id, bmcl::ArrayView<NodeId> members, const Applier& applyer, IStorage* storage, ISender* sender, IEventHandler* events)
-    : _last_cfg_seen(0), _nodes(id), _storage(storage), _committer(storage), _applier(applyer), _sender(sender), _events(&_defaultEventsHandler)
+    : _last_cfg_seen(0), _snapshot_chunk_size(64 * 1024), _max_entries_per_append(4096), _max_bytes_per_append(1024 * 1024), _max_inflight_appends(1), _entry_checksums(false), _entry_poped_events(false), _batch_max_count(1), _batch_max_bytes(std::size_t(-1)), _batch_max_delay(0), _batch_first_idx(0), _batch_count(0), _batch_bytes(0), _batch_age(0), _nodes(id), _storage(storage), _committer(storage), _applier(applyer), _sender(sender), _events(&_defaultEventsHandler)
 {
     set_event_handler(events);
     _current_term = _storage->term();
     _voted_for = _storage->vote();
-    if (members.size() == 1)
+    if (recover())
+    {
+        become_follower();
+        tick();
+    }
+    else if (members.size() == 1)
     {   /*equivalent to Server(id, isNewCluster=true)*/
         assert(*members.begin() == id);
         entry_push(Entry::add_node(_current_term, 0, id), false);
+        _storage->sync();
         become_candidate();
         tick();
         assert(is_leader());
@@ -69,6 +83,7 @@ Server::Server(NodeId id, bmcl::ArrayView<NodeId> members, const Applier& applye
         {
             entry_push(Entry::add_node(_current_term, 0, i), false);
         }
+        _storage->sync();
         assert(_nodes.get_my_node().isSome());
         become_follower();
     }
@@ -79,6 +94,28 @@ Server::Server(NodeId id, std::initializer_list<NodeId> members, const Applier&
 {
 }
 
+bool Server::recover()
+{
+    bmcl::Option<RecoveredState> state = _storage->get_recovered();
+    if (state.isNone())
+        return false;
+
+    /* configuration of the snapshot followed by the changes from the log */
+    Index base = _storage->get_base_idx();
+    bmcl::Option<const Snapshot&> snapshot = _storage->get_snapshot();
+    if (snapshot.isSome())
+    {
+        for (const SnapshotMember& i : snapshot->members)
+            _nodes.add_node(i.id, i.is_voting).set_last_cfg_seen_idx(base);
+    }
+    for (Index idx = base + 1; idx <= _committer.get_current_idx(); ++idx)
+        entry_cfg_change(_committer.get_at_idx(idx).unwrap(), idx);
+    _committer.recover();
+
+    _events->recovered(state->term, state->vote, state->last_idx);
+    return true;
+}
+
 void Server::become_leader()
 {
     set_state(State::Leader);
@@ -92,7 +129,8 @@ void Server::become_leader()
     {
         Node& n = _nodes.get_node(i.get_id()).unwrap();
         n.set_next_idx(_committer.get_current_idx() + 1);
-        n.set_match_idx(!n.is_me() ? 0 : _committer.get_current_idx());
+        n.set_match_idx(!n.is_me() ? 0 : std::min(_storage->get_durable_idx(), _committer.get_current_idx()));
+        n.reset_inflight();
         n.set_need_vote_req(false);
         send_appendentries(n, _sender);
     }
@@ -140,6 +178,7 @@ void Server::become_precandidate()
 void Server::become_follower()
 {
     set_state(State::Follower);
+    drop_proposals();
     _timer.randomize_election_timeout();
     _timer.reset_elapsed();
     _nodes.set_all_need_vote_req(false);
@@ -160,14 +199,31 @@ bmcl::Option<Error> Server::tick(Time elapsed_since_last_period, Index max_count
     {
         vote_for_nodeid(_nodes.get_my_id());
         become_leader();
-        if (_nodes.count() == 1)
-            _committer.commit_all();
     }
 
     if (is_leader())
     {
-        if (_timer.is_time_to_ping())
+        /* entries appended since the last flush are flushed, a failed flush is reported here */
+        if (_storage->get_durable_idx() < _committer.get_current_idx())
         {
+            bmcl::Option<Error> e = _storage->flush();
+            if (e.isSome())
+                return e;
+        }
+        durable_idx_advanced();
+
+        bool ping = _timer.is_time_to_ping();
+        if (_batch_count > 0 && !ping)
+        {
+            _batch_age += elapsed_since_last_period;
+            if (_batch_age >= _batch_max_delay)
+                flush_proposals();
+        }
+
+        if (ping)
+        {
+            /* every node gets what follows its next_idx, held proposals are not sent again by flush_proposals */
+            drop_proposals();
             for (const Node& i : _nodes.items())
             {
                 send_appendentries(_nodes.get_node(i.get_id()).unwrap(), _sender);
@@ -185,9 +241,19 @@ bmcl::Option<Error> Server::tick(Time elapsed_since_last_period, Index max_count
 
 bmcl::Option<Error> Server::apply_all(Index max_count)
 {
+    if (_apply_thread)
+    {
+        bmcl::Option<Error> e = _apply_thread->get_error();
+        if (e.isSome())
+            return e;
+    }
+
     Index i = 0;
     while(i < max_count && _committer.has_not_applied())
     {
+        /* the apply thread is behind, the rest is handed over by a later call */
+        if (_apply_thread && _apply_thread->full())
+            break;
         bmcl::Option<Error> e = entry_apply_one();
         if (e.isSome())
             return e;
@@ -196,6 +262,37 @@ bmcl::Option<Error> Server::apply_all(Index max_count)
     return bmcl::None;
 }
 
+void Server::set_applier(const Applier& applier)
+{
+    _applier = applier;
+    if (_apply_thread)
+        set_apply_thread(_apply_thread->capacity());
+}
+
+void Server::set_apply_thread(std::size_t capacity)
+{
+    if (_apply_thread)
+        _apply_thread->wait_idle();
+    _apply_thread.reset();
+    if (capacity > 0)
+        _apply_thread.reset(new ApplyThread(_applier, capacity, _committer.get_last_applied_idx()));
+}
+
+Index Server::get_applied_idx() const
+{
+    if (_apply_thread)
+        return _apply_thread->get_applied_idx();
+    return _committer.get_last_applied_idx();
+}
+
+bmcl::Option<Error> Server::wait_applied()
+{
+    if (!_apply_thread)
+        return bmcl::None;
+    _apply_thread->wait_idle();
+    return _apply_thread->get_error();
+}
+
 bmcl::Option<Error> Server::accept_rep(NodeId nodeid, const MsgAppendEntriesRep& r)
 {
     if (is_shutdown())
@@ -227,6 +324,10 @@ bmcl::Option<Error> Server::accept_rep(NodeId nodeid, const MsgAppendEntriesRep&
 
     if (!r.success)
     {
+        /* batches which followed the rejected one are rejected too, they were already resent */
+        if (node->take_stale_reject())
+            return bmcl::None;
+
         /* If AppendEntries fails because of log inconsistency:
            decrement nextIndex and retry (§5.3) */
         Index next_idx = node->get_next_idx();
@@ -235,43 +336,54 @@ bmcl::Option<Error> Server::accept_rep(NodeId nodeid, const MsgAppendEntriesRep&
         assert(node->get_match_idx() <= next_idx - 1);
         if (node->get_match_idx() == next_idx - 1)
             return bmcl::None;
+        /* the node can't have less than it acknowledged, the rejected batch was sent before that */
+        if (r.current_idx < node->get_match_idx())
+            return bmcl::None;
 
-        if (r.current_idx < next_idx - 1)
-            node->set_next_idx(std::min<Index>(r.current_idx + 1, _committer.get_current_idx()));
+        if (r.conflict_term != 0)
+        {
+            /* skip the whole conflicting term, or continue after our last entry of it (§5.3) */
+            bmcl::Option<Index> last = _committer.get_last_idx_of_term(r.conflict_term, next_idx - 1);
+            Index idx = last.isSome() ? last.unwrap() + 1 : r.conflict_idx;
+            node->set_next_idx(std::max<Index>(std::min<Index>(idx, next_idx - 1), node->get_match_idx() + 1));
+        }
+        else if (r.current_idx < next_idx - 1)
+            node->set_next_idx(std::max<Index>(std::min<Index>(r.current_idx + 1, _committer.get_current_idx()), node->get_match_idx() + 1));
         else
             node->set_next_idx(next_idx - 1);
 
+        /* the rejected batch is the oldest one in flight, the ones sent after it will be rejected too */
+        std::size_t inflight = node->get_inflight_count();
+        node->reset_inflight(inflight > 0 ? inflight - 1 : 0);
+
         /* retry */
         send_appendentries(node.unwrap(), _sender);
         return bmcl::None;
     }
 
+    /* duplicated or overtaken by a later ack, it covers no batch which is still in flight */
     if (r.current_idx <= node->get_match_idx())
         return bmcl::None;
+    node->ack_inflight(r.current_idx);
 
     assert(r.current_idx <= _committer.get_current_idx());
 
-    node->set_next_idx(r.current_idx + 1);
+    /* next_idx is already ahead if batches are pipelined */
+    if (_max_inflight_appends <= 1 || node->get_next_idx() <= r.current_idx)
+        node->set_next_idx(r.current_idx + 1);
     node->set_match_idx(r.current_idx);
 
-    if (!node->is_voting() && !_committer.voting_change_is_in_progress() && _committer.get_current_idx() <= r.current_idx + 1)
+    if (!node->is_voting() && _nodes.has_free_voting_slot() && !_committer.voting_change_is_in_progress() && _committer.get_current_idx() <= r.current_idx + 1)
     {
         auto e = entry_push(Entry::add_node(get_current_term(), EntryId(0), node->get_id()), false);
         if (e.isSome())
             return e;
+        e = _storage->flush();
+        if (e.isSome())
+            return e;
     }
 
-    /* Update commit idx */
-    Index point = r.current_idx;
-    if (point > 0)
-    {
-        bmcl::Option<const Entry&> ety = _committer.get_at_idx(point);
-        assert(ety.isSome());
-        if (!_committer.is_committed(point) && ety.unwrap().term() == _current_term && _nodes.is_committed(point))
-        {
-            _committer.set_commit_idx(point);
-        }
-    }
+    durable_idx_advanced();
 
     /* Aggressively send remaining entries */
     if (_committer.get_at_idx(node->get_next_idx()).isSome())
@@ -282,9 +394,9 @@ bmcl::Option<Error> Server::accept_rep(NodeId nodeid, const MsgAppendEntriesRep&
     return bmcl::None;
 }
 
-MsgAppendEntriesRep Server::prepare_response(NodeId nodeid, bool success, Index index)
+MsgAppendEntriesRep Server::prepare_response(NodeId nodeid, bool success, Index index, TermId conflict_term, Index conflict_idx)
 {
-    MsgAppendEntriesRep rep(_current_term, success, index);
+    MsgAppendEntriesRep rep(_current_term, success, index, conflict_term, conflict_idx);
     _events->send(nodeid, rep);
     return rep;
 }
@@ -321,82 +433,251 @@ bmcl::Result<MsgAppendEntriesRep, Error> Server::accept_req(NodeId nodeid, const
     _timer.reset_elapsed();
 
     /* Not the first appendentries we've received */
-    /* NOTE: the log starts at 1 */
-    if (0 < ae.data.prev_log_idx())
+    /* NOTE: the log starts at 1, entries replaced by snapshot are committed, so they match */
+    if (_committer.get_base_idx() < ae.data.prev_log_idx())
     {
-        bmcl::Option<const Entry&> e = _committer.get_at_idx(ae.data.prev_log_idx());
-        if (e.isNone())
+        bmcl::Option<TermId> term = _committer.get_term_at_idx(ae.data.prev_log_idx());
+        if (term.isNone())
         {
             /* 2. Reply false if log doesn't contain an entry at prevLogIndex whose term matches prevLogTerm (§5.3) */
             //__log("AE no log at prev_idx %d for ", ae.data.prev_log_idx(), nodeid);
             return prepare_response(nodeid, false, _committer.get_current_idx());
         }
+        /* term 0 is not checked: entries of term 0 are the initial configuration, which every member creates the same way */
+        if (ae.prev_log_term != 0 && term.unwrap() != 0 && term.unwrap() != ae.prev_log_term && !_committer.is_committed(ae.data.prev_log_idx()))
+        {
+            /* tell the leader where the conflicting term starts, so it skips the whole term at once */
+            Index conflict_idx = _committer.get_first_idx_of_term(ae.data.prev_log_idx());
+            return prepare_response(nodeid, false, _committer.get_current_idx(), term.unwrap(), conflict_idx);
+        }
     }
 
-    Index node_current_idx = ae.data.prev_log_idx();
+    /* skip entries we already have in snapshot */
+    Index i = 0;
+    if (ae.data.prev_log_idx() < _committer.get_base_idx())
+        i = std::min<Index>(ae.data.count(), _committer.get_base_idx() - ae.data.prev_log_idx());
+
+    Index node_current_idx = ae.data.prev_log_idx() + i;
+
+    /* a damaged batch is dropped before it touches the log, leader resends it */
+    for (Index k = i; k < ae.data.count(); ++k)
+    {
+        if (!ae.data.get_at_idx(ae.data.prev_log_idx() + 1 + k)->is_intact())
+            return Error::Corrupted;
+    }
 
-    Index i;
-    for (i = 0; i < ae.data.count(); i++)
+    for (; i < ae.data.count(); i++)
     {
         Index ety_index = ae.data.prev_log_idx() + 1 + i;
-        bmcl::Option<const Entry&> existing_ety = _committer.get_at_idx(ety_index);
-        if (existing_ety.isNone())
+        bmcl::Option<TermId> existing_term = _committer.get_term_at_idx(ety_index);
+        if (existing_term.isNone())
             break;
         bmcl::Option<const Entry&> ety = ae.data.get_at_idx(ety_index);
         node_current_idx = ety_index;
-        if (existing_ety.unwrap().term() != ety->term() && !_committer.is_committed(ety_index))
+        if (existing_term.unwrap() != ety->term() && !_committer.is_committed(ety_index))
         {
             /* 3. If an existing entry conflicts with a new one (same index
             but different terms), delete the existing entry and all that
             follow it (§5.3) */
-            bool flag = true;
-            while (_committer.get_current_idx() >= ety_index)
+            Index last_idx = _committer.get_current_idx();
+            /* only configuration changes have to be reverted */
+            const std::deque<Index>& cfg_changes = _committer.get_cfg_change_idxs();
+            for (auto idx = cfg_changes.rbegin(); idx != cfg_changes.rend() && *idx >= ety_index; ++idx)
+                entry_pop(_committer.get_at_idx(*idx).unwrap());
+            if (_entry_poped_events)
             {
-                bmcl::Option<Entry> pop = _committer.entry_pop_back(/*[this](const InternalData& ety) { pop_log(ety); }*/);
-                if (pop.isNone())
-                {
-                    flag = false;
-                    continue;
-                }
-                entry_pop(pop.unwrap());
-                _events->entry_poped(_committer.get_current_idx(), pop.unwrap());
+                for (Index idx = last_idx; idx >= ety_index; --idx)
+                    _events->entry_poped(idx - 1, _committer.get_at_idx(idx).unwrap());
             }
+            bmcl::Option<Error> e = _committer.entry_truncate_from(ety_index);
+            if (e.isSome())
+                return e.unwrap();
+            _events->entries_truncated(ety_index, last_idx);
             break;
         }
     }
 
-    /* Pick up remainder in case of mismatch or missing entry */
-    for (; i < ae.data.count(); i++)
+    /* Pick up remainder in case of mismatch or missing entry, the whole remainder is stored at once */
+    if (i < ae.data.count())
     {
-        Index ety_index = ae.data.prev_log_idx() + 1 + i;
-
-        bmcl::Option<const Entry&> ety = ae.data.get_at_idx(ety_index);
-        if (ety.isNone())
-        {
-            //__log(); //unable to deserialize?
-            break;
-        }
-
-        bmcl::Option<Error> e = entry_push(ety.unwrap(), false);
-        if (e.isSome())
+        Index first = _committer.get_current_idx() + 1;
+        bmcl::Option<Error> e = _committer.entry_append_range(ae.data.tail(ae.data.prev_log_idx() + i));
+        for (Index idx = first; idx <= _committer.get_current_idx(); ++idx)
+            entry_cfg_change(_committer.get_at_idx(idx).unwrap(), idx);
+        sync_log_and_nodes();
+        node_current_idx = _committer.get_current_idx();
+
+        if (e.isSome() && e.unwrap() == Error::Shutdown)
         {
-            if (e.unwrap() == Error::Shutdown)
-            {
-                set_state(State::Shutdown);
-                //return MsgAppendEntriesRep(current_term, false, node_current_idx, 0);
-                return Error::Shutdown;
-            }
-            break;
+            set_state(State::Shutdown);
+            return Error::Shutdown;
         }
-        node_current_idx = ety_index;
     }
 
+    /* entries must be durable before we report them, one sync for the whole batch */
+    bmcl::Option<Error> e = _storage->sync();
+    if (e.isSome())
+        return e.unwrap();
+
     /* 4. If leaderCommit > commitIndex, set commitIndex =
         min(leaderCommit, index of most recent entry) */
     _committer.commit_till(ae.leader_commit);
     return prepare_response(nodeid, true, node_current_idx);
 }
 
+MsgInstallSnapshotRep Server::prepare_snapshot_response(NodeId nodeid, Index last_idx, std::size_t offset, bool done)
+{
+    MsgInstallSnapshotRep rep(_current_term, last_idx, offset, done);
+    _events->send(nodeid, rep);
+    return rep;
+}
+
+bmcl::Result<MsgInstallSnapshotRep, Error> Server::accept_req(NodeId nodeid, const MsgInstallSnapshotReq& req)
+{
+    if (is_shutdown())
+        return Error::Shutdown;
+
+    _events->rcvd(nodeid, req);
+
+    if (_current_term == req.term)
+    {
+        assert(!is_leader());
+        if (is_candidate() || is_precandidate())
+            become_follower();
+    }
+    else if (req.term > _current_term)
+    {
+        set_current_term(req.term);
+        become_follower();
+    }
+    else
+    {
+        return prepare_snapshot_response(nodeid, req.last_idx, 0, false);
+    }
+
+    _current_leader = nodeid;
+    _timer.reset_elapsed();
+
+    /* we already have every entry the snapshot replaces */
+    if (req.last_idx <= _committer.get_commit_idx())
+    {
+        _snapshot_rcv.clear();
+        _snapshot_rcv_data.clear();
+        return prepare_snapshot_response(nodeid, req.last_idx, req.offset + req.chunk.size(), true);
+    }
+
+    if (_snapshot_rcv.isNone() || _snapshot_rcv->last_idx != req.last_idx || _snapshot_rcv->last_term != req.last_term)
+    {
+        if (req.offset != 0)
+            return prepare_snapshot_response(nodeid, req.last_idx, 0, false);
+        Snapshot snapshot;
+        snapshot.last_idx = req.last_idx;
+        snapshot.last_term = req.last_term;
+        _snapshot_rcv = snapshot;
+        _snapshot_rcv_data.clear();
+    }
+
+    /* duplicated or out of order chunk, leader continues from what we have */
+    std::vector<uint8_t>& data = _snapshot_rcv_data;
+    if (req.offset != data.size())
+        return prepare_snapshot_response(nodeid, req.last_idx, data.size(), false);
+
+    data.insert(data.end(), req.chunk.begin(), req.chunk.end());
+    if (!req.done)
+        return prepare_snapshot_response(nodeid, req.last_idx, data.size(), false);
+
+    std::size_t size = data.size();
+    _snapshot_rcv->members.assign(req.members.begin(), req.members.end());
+    _snapshot_rcv->data = UserData(std::move(data));
+    data.clear();
+    bmcl::Option<Error> e = install_snapshot(_snapshot_rcv.unwrap());
+    _snapshot_rcv.clear();
+    if (e.isSome())
+        return e.unwrap();
+    return prepare_snapshot_response(nodeid, req.last_idx, size, true);
+}
+
+bmcl::Option<Error> Server::install_snapshot(const Snapshot& snapshot)
+{
+    /* the state machine is replaced, entries before the snapshot have to be applied by then */
+    bmcl::Option<Error> e = wait_applied();
+    if (e.isSome())
+        return e;
+
+    if (_snapshot_applier)
+    {
+        e = _snapshot_applier(snapshot);
+        if (e.isSome())
+            return e;
+    }
+
+    e = _committer.install(snapshot);
+    if (e.isSome())
+        return e;
+    /* the apply thread continues after the snapshot */
+    if (_apply_thread)
+        set_apply_thread(_apply_thread->capacity());
+
+    /* configuration of the snapshot followed by the changes from the entries left after it */
+    _nodes = Nodes(_nodes.get_my_id());
+    for (const SnapshotMember& i : snapshot.members)
+        _nodes.add_node(i.id, i.is_voting).set_last_cfg_seen_idx(snapshot.last_idx);
+    for (Index idx = snapshot.last_idx + 1; idx <= _committer.get_current_idx(); ++idx)
+        entry_cfg_change(_committer.get_at_idx(idx).unwrap(), idx);
+
+    _events->snapshot_installed(snapshot);
+    return bmcl::None;
+}
+
+bmcl::Option<Error> Server::accept_rep(NodeId nodeid, const MsgInstallSnapshotRep& r)
+{
+    if (is_shutdown())
+        return Error::Shutdown;
+
+    bmcl::Option<Node&> node = _nodes.get_node(nodeid);
+    _events->rcvd(nodeid, r);
+
+    if (node.isNone())
+        return Error::NodeUnknown;
+
+    if (!is_leader())
+        return Error::NotLeader;
+
+    if (_current_term < r.term)
+    {
+        bmcl::Option<Error> e = set_current_term(r.term);
+        if (e.isSome())
+            return e;
+        become_follower();
+        _current_leader.clear();
+        return bmcl::None;
+    }
+
+    if (_current_term > r.term)
+        return bmcl::None;
+
+    /* response for the snapshot we don't send anymore */
+    if (r.last_idx != node->get_snapshot_idx())
+        return bmcl::None;
+
+    if (!r.done)
+    {
+        node->set_snapshot_progress(r.last_idx, r.offset);
+        return send_snapshot(node.unwrap(), _sender);
+    }
+
+    node->set_snapshot_progress(0, 0);
+    node->reset_inflight();
+    if (node->get_match_idx() < r.last_idx)
+        node->set_match_idx(r.last_idx);
+    if (node->get_next_idx() <= r.last_idx)
+        node->set_next_idx(r.last_idx + 1);
+
+    if (_committer.get_at_idx(node->get_next_idx()).isSome())
+        send_appendentries(node.unwrap(), _sender);
+    return bmcl::None;
+}
+
 bool Server::should_grant_vote(const MsgVoteReq& vr) const
 {
     /* TODO: 4.2.3 Raft Dissertation:
@@ -422,15 +703,15 @@ bool Server::should_grant_vote(const MsgVoteReq& vr) const
     if (0 == current_idx)
         return true;
 
-    bmcl::Option<const Entry&> e = _committer.get_at_idx(current_idx);
-    assert((current_idx != 0) == e.isSome());
-    if (e.isNone())
+    bmcl::Option<TermId> term = _committer.get_last_log_term();
+    assert((current_idx != 0) == term.isSome());
+    if (term.isNone())
         return true;
 
-    if (e.unwrap().term() < vr.last_log_term)
+    if (term.unwrap() < vr.last_log_term)
         return true;
 
-    if (vr.last_log_term == e.unwrap().term() && current_idx <= vr.last_log_idx)
+    if (vr.last_log_term == term.unwrap() && current_idx <= vr.last_log_idx)
         return true;
 
     return false;
@@ -544,6 +825,9 @@ bmcl::Option<Error> Server::accept_rep(NodeId nodeid, const MsgVoteRep& r)
 
 bmcl::Result<MsgAddEntryRep, Error> Server::add_node(EntryId id, NodeId nodeid)
 {
+    /* the node is promoted once it catches up, which needs a free voting slot */
+    if (is_leader() && !_nodes.has_free_voting_slot())
+        return Error::TooManyVotingNodes;
     return accept_entry(Entry::add_nonvoting_node(_current_term, id, nodeid));
 }
 
@@ -560,7 +844,17 @@ bmcl::Result<MsgAddEntryRep, Error> Server::add_entry(EntryId id, const UserData
     return accept_entry(Entry(_current_term, id, data));
 }
 
-bmcl::Result<MsgAddEntryRep, Error> Server::accept_entry(const Entry& ety)
+bmcl::Result<MsgAddEntryRep, Error> Server::add_entry(EntryId id, UserData&& data)
+{
+    return accept_entry(Entry(_current_term, id, std::move(data)));
+}
+
+bmcl::Result<MsgAddEntryRep, Error> Server::add_packed_entry(EntryId id, UserData commands)
+{
+    return accept_entry(Entry::user_packed(_current_term, id, std::move(commands)));
+}
+
+bmcl::Result<MsgAddEntryRep, Error> Server::accept_entry(Entry&& ety)
 {
     if (is_shutdown())
         return Error::Shutdown;
@@ -570,14 +864,103 @@ bmcl::Result<MsgAddEntryRep, Error> Server::accept_entry(const Entry& ety)
 
     _events->entry_rcvd(ety);
     assert(ety.term() == _current_term);
-    auto r = entry_push(ety, true);
+    if (_entry_checksums)
+        ety.seal();
+    EntryId id = ety.id();
+    auto r = entry_push(std::move(ety), true);
+    if (r.isSome())
+        return r.unwrap();
+
+    /* the entry is replicated while it is being flushed, our own match index is the durable one */
+    r = _storage->flush();
     if (r.isSome())
         return r.unwrap();
 
-    _events->entry_stored(_committer.get_current_idx() - 1, ety);
-    /* if we're the only node, we can consider the entry committed */
-    if (_nodes.is_me_the_only_voting())
-        _committer.commit_all();
+    const Entry& stored = _committer.get_at_idx(_committer.get_current_idx()).unwrap();
+    _events->entry_stored(_committer.get_current_idx() - 1, stored);
+    durable_idx_advanced();
+
+    hold_proposals(_committer.get_current_idx(), 1, stored.size());
+    return MsgAddEntryRep(_current_term, id, _committer.get_current_idx());
+}
+
+bmcl::Result<MsgAddEntriesRep, Error> Server::add_entries(bmcl::ArrayView<Proposal> proposals)
+{
+    if (is_shutdown())
+        return Error::Shutdown;
+
+    if (!is_leader())
+        return Error::NotLeader;
+
+    Index first = _committer.get_current_idx() + 1;
+    if (proposals.size() == 0)
+        return MsgAddEntriesRep(_current_term, first, first - 1);
+
+    std::vector<Entry> entries;
+    entries.reserve(proposals.size());
+    std::size_t bytes = 0;
+    for (const Proposal& i : proposals)
+    {
+        entries.emplace_back(_current_term, i.id, i.data);
+        if (_entry_checksums)
+            entries.back().seal();
+        bytes += entries.back().size();
+        _events->entry_rcvd(entries.back());
+    }
+
+    bmcl::Option<Error> e = _committer.entry_append_range(DataHandler(entries.data(), first - 1, entries.size()));
+    sync_log_and_nodes();
+    Index last = _committer.get_current_idx();
+    for (Index idx = first; idx <= last; ++idx)
+        _events->entry_stored(idx - 1, _committer.get_at_idx(idx).unwrap());
+
+    /* the stored part is replicated even if the rest failed */
+    if (e.isNone())
+        e = _storage->flush();
+    durable_idx_advanced();
+    if (last >= first)
+        hold_proposals(first, last - first + 1, bytes);
+    if (e.isSome())
+        return e.unwrap();
+
+    return MsgAddEntriesRep(_current_term, first, last);
+}
+
+void Server::hold_proposals(Index first_idx, Index count, std::size_t bytes)
+{
+    if (_batch_count == 0)
+        _batch_first_idx = first_idx;
+    _batch_count += count;
+    _batch_bytes += bytes;
+    if (_batch_count >= _batch_max_count || _batch_bytes >= _batch_max_bytes)
+        flush_proposals();
+}
+
+void Server::set_proposal_batch(Index count, std::size_t bytes, Time max_delay)
+{
+    _batch_max_count = count < 1 ? 1 : count;
+    _batch_max_bytes = bytes;
+    _batch_max_delay = max_delay;
+    if (_batch_count >= _batch_max_count || _batch_bytes >= _batch_max_bytes)
+        flush_proposals();
+}
+
+void Server::drop_proposals()
+{
+    _batch_first_idx = 0;
+    _batch_count = 0;
+    _batch_bytes = 0;
+    _batch_age = Time(0);
+}
+
+void Server::flush_proposals()
+{
+    if (_batch_count == 0)
+        return;
+    const Index first = _batch_first_idx;
+    drop_proposals();
+    if (!is_leader())
+        return;
 
     for (const Node& i: _nodes.items())
     {
@@ -585,17 +968,15 @@ bmcl::Result<MsgAddEntryRep, Error> Server::accept_entry(const Entry& ety)
             continue;
 
         /* Only send new entries.
-         * Don't send the entry to peers who are behind, to prevent them from
+         * Don't send the entries to peers who are behind, to prevent them from
          * becoming congested. */
         Index next_idx = i.get_next_idx();
-        if (next_idx == _committer.get_current_idx())
+        if (next_idx == first)
         {
             Node& n = _nodes.get_node(i.get_id()).unwrap();
             send_appendentries(n, _sender);
         }
     }
-
-    return MsgAddEntryRep(_current_term, ety.id(), _committer.get_current_idx());
 }
 
 bmcl::Option<Error> Server::entry_apply_one()
@@ -603,7 +984,13 @@ bmcl::Option<Error> Server::entry_apply_one()
     if (is_shutdown())
         return Error::Shutdown;
 
-    auto r = _committer.entry_apply_one(_applier);
+    auto r = !_apply_thread ? _committer.entry_apply_one(_applier) : _committer.entry_apply_one([this](Index idx, const Entry& ety)
+    {
+        bool pushed = _apply_thread->push(idx, ety);
+        assert(pushed);
+        (void)pushed;
+        return bmcl::Option<Error>();
+    });
     if (r.isErr())
     {
         if (r.unwrapErr() == Error::NothingToApply)
@@ -656,6 +1043,11 @@ bmcl::Option<Error> Server::entry_apply_one()
 }
 
 void Server::entry_pop(const Entry& ety)
+{
+    entry_revert(_nodes, ety);
+}
+
+void Server::entry_revert(Nodes& nodes, const Entry& ety)
 {
     if (ety.isUser())
         return;
@@ -668,26 +1060,26 @@ void Server::entry_pop(const Entry& ety)
     {
     case InternalData::AddNonVotingNode:
     {
-        _nodes.remove_node(id);
+        nodes.remove_node(id);
     }
     break;
     case InternalData::AddNode:
     {
-        node = _nodes.get_node(id);
+        node = nodes.get_node(id);
         if (node.isSome())
             node->set_voting(false);
     }
     break;
     case InternalData::DemoteNode:
     {
-        node = _nodes.get_node(id);
+        node = nodes.get_node(id);
         if (node.isSome())
             node->set_voting(true);
     }
     break;
     case InternalData::RemoveNode:
     {
-        node = _nodes.add_node(id, false);
+        node = nodes.add_node(id, false);
     }
     break;
     case InternalData::Noop:
@@ -699,16 +1091,21 @@ void Server::entry_pop(const Entry& ety)
     }
 }
 
-bmcl::Option<Error> Server::entry_push(const Entry& ety, bool needVoteChecks)
+bmcl::Option<Error> Server::entry_push(Entry&& ety, bool needVoteChecks)
 {
-    auto e = _committer.entry_push_back(ety, needVoteChecks);
+    auto e = _committer.entry_push_back(std::move(ety), needVoteChecks);
     if (e.isSome())
         return e;
 
     sync_log_and_nodes();
+    entry_cfg_change(_committer.get_at_idx(_committer.get_current_idx()).unwrap(), _committer.get_current_idx());
+    return bmcl::None;
+}
 
+void Server::entry_cfg_change(const Entry& ety, Index idx)
+{
     if (ety.isUser())
-        return bmcl::None;
+        return;
 
     const InternalData& cmd = ety.getInternalData().unwrap();
     NodeId id = cmd.node;
@@ -718,12 +1115,12 @@ bmcl::Option<Error> Server::entry_push(const Entry& ety, bool needVoteChecks)
     {
     case InternalData::AddNonVotingNode:
         node = _nodes.add_node(id, false);
-        node->set_last_cfg_seen_idx(_committer.get_current_idx());
+        node->set_last_cfg_seen_idx(idx);
         break;
 
     case InternalData::AddNode:
         node = _nodes.add_node(id, true);
-        node->set_last_cfg_seen_idx(_committer.get_current_idx());
+        node->set_last_cfg_seen_idx(idx);
         break;
 
     case InternalData::DemoteNode:
@@ -742,8 +1139,6 @@ bmcl::Option<Error> Server::entry_push(const Entry& ety, bool needVoteChecks)
     default:
         assert(false);
     }
-
-    return bmcl::None;
 }
 
 bmcl::Option<Error> Server::send_smth_for(NodeId node, ISender* sender)
@@ -810,19 +1205,55 @@ bmcl::Option<Error> Server::send_appendentries(Node& node, ISender* sender)
         return bmcl::None;
     }
 
-    Index next_idx = node.get_next_idx();
-    MsgAppendEntriesReq ae(_current_term, TermId(0), _committer.get_commit_idx(), node.get_last_cfg_seen_idx(), _committer.get_from_idx(next_idx));
-
-    /* previous log is the log just before the new logs */
-    if (1 < next_idx)
+    bool pipelined = _max_inflight_appends > 1;
+    do
     {
-        bmcl::Option<const Entry&> prev_ety = _committer.get_at_idx(next_idx - 1);
-        if (prev_ety.isSome())
-            ae.prev_log_term = prev_ety.unwrap().term();
-    }
+        Index next_idx = node.get_next_idx();
+        if (next_idx <= _committer.get_base_idx())
+            return send_snapshot(node, sender);
+
+        /* full window, only a heartbeat goes out. It follows what the node acked, the batches in flight may
+         * arrive later or get lost, and a heartbeat after them would be rejected and roll the window back */
+        Index max_count = _max_entries_per_append;
+        if (pipelined && node.get_inflight_count() >= _max_inflight_appends)
+        {
+            max_count = 0;
+            next_idx = std::max(node.get_match_idx(), _committer.get_base_idx()) + 1;
+        }
+
+        MsgAppendEntriesReq ae(_current_term, TermId(0), _committer.get_commit_idx(), node.get_last_cfg_seen_idx(), _committer.get_from_idx(next_idx, max_count, _max_bytes_per_append));
+
+        /* previous log is the log just before the new logs */
+        if (1 < next_idx)
+            ae.prev_log_term = _committer.get_term_at_idx(next_idx - 1).unwrapOr(TermId(0));
+
+        _events->send(node.get_id(), ae);
+        bmcl::Option<Error> e = sender->append_entries(node.get_id(), ae);
+        if (e.isSome() || !pipelined || ae.data.empty())
+            return e;
+
+        node.set_next_idx(next_idx + ae.data.count());
+        node.add_inflight(next_idx + ae.data.count() - 1);
+    } while (node.get_inflight_count() < _max_inflight_appends && _committer.get_at_idx(node.get_next_idx()).isSome());
+
+    return bmcl::None;
+}
 
-    _events->send(node.get_id(), ae);
-    return sender->append_entries(node.get_id(), ae);
+bmcl::Option<Error> Server::send_snapshot(Node& node, ISender* sender)
+{
+    const Snapshot& snapshot = _storage->get_snapshot().unwrap();
+    if (node.get_snapshot_idx() != snapshot.last_idx)
+        node.set_snapshot_progress(snapshot.last_idx, 0);
+
+    const Buffer& data = snapshot.data.data;
+    std::size_t offset = std::min(node.get_snapshot_offset(), data.size());
+    std::size_t size = std::min(_snapshot_chunk_size, data.size() - offset);
+    MsgInstallSnapshotReq req(_current_term, snapshot.last_idx, snapshot.last_term, offset, offset + size == data.size(),
+                              bmcl::ArrayView<uint8_t>(data.data() + offset, size),
+                              bmcl::ArrayView<SnapshotMember>(snapshot.members.data(), snapshot.members.size()));
+
+    _events->send(node.get_id(), req);
+    return sender->install_snapshot(node.get_id(), req);
 }
 
 bmcl::Option<Error> Server::vote_for_nodeid(NodeId nodeid)
@@ -866,10 +1297,50 @@ void Server::sync_log_and_nodes()
     if (me.isNone())
         return;
 
-    me->set_match_idx(_committer.get_current_idx());
+    me->set_match_idx(std::min(_storage->get_durable_idx(), _committer.get_current_idx()));
     me->set_next_idx(_committer.get_current_idx() + 1);
 }
 
+void Server::durable_idx_advanced()
+{
+    if (!is_leader())
+        return;
+    sync_log_and_nodes();
+    update_commit_idx();
+}
+
+void Server::update_commit_idx()
+{
+    /* highest idx stored on a majority, so acks which come out of order don't delay it */
+    Index point = std::min(_nodes.get_quorum_idx(), _committer.get_current_idx());
+    if (point > 0 && !_committer.is_committed(point))
+    {
+        bmcl::Option<TermId> term = _committer.get_term_at_idx(point);
+        if (term == _current_term)
+            _committer.set_commit_idx(point);
+    }
+}
+
+bmcl::Option<Error> Server::compact(const UserData& data)
+{
+    /* the image follows every entry handed to the apply thread */
+    bmcl::Option<Error> e = wait_applied();
+    if (e.isSome())
+        return e;
+
+    /* configuration as of the last applied entry: revert the changes which are not applied yet */
+    Nodes nodes = _nodes;
+    const std::deque<Index>& cfg_changes = _committer.get_cfg_change_idxs();
+    for (auto idx = cfg_changes.rbegin(); idx != cfg_changes.rend() && *idx > _committer.get_last_applied_idx(); ++idx)
+        entry_revert(nodes, _committer.get_at_idx(*idx).unwrap());
+
+    std::vector<SnapshotMember> members;
+    for (const Node& i : nodes.items())
+        members.emplace_back(i.get_id(), i.is_voting());
+
+    return _committer.compact(data, members);
+}
+
 bmcl::Option<Error> Server::start_election()
 {
     if (!is_follower())
@@ -9,11 +9,13 @@
 
 #pragma once
 #include <chrono>
+#include <memory>
 #include <bmcl/Option.h>
 #include <bmcl/Result.h>
 #include <bmcl/ArrayView.h>
 #include "raft/Types.h"
 #include "raft/Committer.h"
+#include "raft/ApplyThread.h"
 #include "raft/Node.h"
 #include "raft/Timer.h"
 
@@ -35,12 +37,33 @@ class Server
 {
     friend class Logger;
 public:
-    explicit Server(NodeId id, bool isnewCluster, const Applier& applyer, IStorage* storage, ISender* sender = nullptr, IEventHandler* events = nullptr); //create new or join existing cluster ()
+    explicit Server(NodeId id, bool isnewCluster, const Applier& applyer, IStorage* storage, ISender* sender = nullptr, IEventHandler* events = nullptr); //create new or join existing cluster (), or restart the member whose log the storage keeps
     explicit Server(NodeId id, bmcl::ArrayView<NodeId> members, const Applier& applyer, IStorage* storage, ISender* sender = nullptr, IEventHandler* events = nullptr); //create new cluster with initial set of members, which includes id
     explicit Server(NodeId id, std::initializer_list<NodeId> members, const Applier& applyer, IStorage* storage, ISender* sender = nullptr, IEventHandler* events = nullptr); //create new cluster with initial set of members, which includes id
 
     inline void set_sender(ISender* sender) {_sender = sender; }
-    inline void set_applier(const Applier& applier) { _applier = applier; }
+    /** The apply thread, if there is one, is restarted with the new applier once it applied what it has */
+    void set_applier(const Applier& applier);
+    inline void set_snapshot_applier(const SnapshotApplier& applier) { _snapshot_applier = applier; }
+    inline void set_snapshot_chunk_size(std::size_t size) { _snapshot_chunk_size = size < 1 ? 1 : size; }
+    inline std::size_t get_snapshot_chunk_size() const { return _snapshot_chunk_size; }
+    inline void set_max_entries_per_append(Index count) { _max_entries_per_append = count < 1 ? 1 : count; }
+    inline Index get_max_entries_per_append() const { return _max_entries_per_append; }
+    inline void set_max_bytes_per_append(std::size_t size) { _max_bytes_per_append = size; }
+    inline std::size_t get_max_bytes_per_append() const { return _max_bytes_per_append; }
+    /** With a window above 1 next_idx advances as soon as entries are sent, so up to count batches are in flight */
+    inline void set_max_inflight_appends(std::size_t count) { _max_inflight_appends = count < 1 ? 1 : count; }
+    inline std::size_t get_max_inflight_appends() const { return _max_inflight_appends; }
+    /** Leader seals its new entries with a crc32c, which is checked by followers and by the storage */
+    inline void set_entry_checksums(bool enable) { _entry_checksums = enable; }
+    inline bool get_entry_checksums() const { return _entry_checksums; }
+    /** For handlers written before IEventHandler::entries_truncated: a truncated tail also fires entry_poped
+     * for every dropped entry. Off by default, entries_truncated is the only event then. */
+    inline void set_entry_poped_events(bool enable) { _entry_poped_events = enable; }
+    /** Leader appends proposals to its log at once but holds their AppendEntries until count entries or bytes of
+     * payload are pending, or a tick comes max_delay after the first of them. A count of 1 sends every proposal. */
+    void set_proposal_batch(Index count, std::size_t bytes = std::size_t(-1), Time max_delay = Time(0));
+    inline Index get_proposal_batch_count() const { return _batch_max_count; }
     inline void set_event_handler(IEventHandler* events) { _events = events; if (!_events) _events = &_defaultEventsHandler; }
 
     inline bmcl::Option<NodeId> get_current_leader() const { return _current_leader; }
@@ -64,23 +87,58 @@ public:
     bmcl::Option<Error> tick(Time elapsed = Time(0), Index max_count = Index(-1));
     bmcl::Option<Error> apply_all(Index max_count = Index(-1));
 
+    /** Committed entries are handed to a thread which applies them with the current applier, up to capacity of
+     * them wait for it. Membership changes still take effect on the thread of the server, in log order,
+     * and IEventHandler::entry_applied fires when the entry is handed over, not when the thread applied it.
+     * A capacity of 0 waits for the thread and applies on the thread of the server again. */
+    void set_apply_thread(std::size_t capacity);
+    inline bool has_apply_thread() const { return _apply_thread != nullptr; }
+    /** highest idx applied to the state machine, it trails committer().get_last_applied_idx() with the apply thread */
+    Index get_applied_idx() const;
+    /** Blocks till the apply thread applied every entry handed to it */
+    bmcl::Option<Error> wait_applied();
+
     bmcl::Result<MsgAppendEntriesRep, Error> accept_req(NodeId nodeid, const MsgAppendEntriesReq& ae);
     bmcl::Option<Error> accept_rep(NodeId nodeid, const MsgAppendEntriesRep& r);
     bmcl::Result<MsgVoteRep, Error> accept_req(NodeId nodeid, const MsgVoteReq& vr);
     bmcl::Option<Error> accept_rep(NodeId nodeid, const MsgVoteRep& r);
+    bmcl::Result<MsgInstallSnapshotRep, Error> accept_req(NodeId nodeid, const MsgInstallSnapshotReq& req);
+    bmcl::Option<Error> accept_rep(NodeId nodeid, const MsgInstallSnapshotRep& r);
 
     bmcl::Result<MsgAddEntryRep, Error> add_entry(EntryId id, const UserData& data);
+    bmcl::Result<MsgAddEntryRep, Error> add_entry(EntryId id, UserData&& data);
+    /** Proposes commands packed by CommandPacker as one entry, the applier reads them with Entry::get_commands */
+    bmcl::Result<MsgAddEntryRep, Error> add_packed_entry(EntryId id, UserData commands);
+    /** Appends the proposals with one storage call and one flush, followers get them in a single AppendEntries */
+    bmcl::Result<MsgAddEntriesRep, Error> add_entries(bmcl::ArrayView<Proposal> proposals);
+    /** Fails with TooManyVotingNodes if the node couldn't be promoted to voting, see ReplicationState::Capacity */
     bmcl::Result<MsgAddEntryRep, Error> add_node(EntryId id, NodeId node);
     bmcl::Result<MsgAddEntryRep, Error> remove_node(EntryId id, NodeId node);
     bmcl::Option<Error> start_election();
 
+    /** Replaces applied entries with the state machine image taken right after committer().get_last_applied_idx().
+     * With the apply thread the image is taken after wait_applied(). */
+    bmcl::Option<Error> compact(const UserData& data);
+
     bmcl::Option<Error> send_appendentries(NodeId node);
+    /** Sends proposals held by the batching window to the followers that were up to date */
+    void flush_proposals();
     bmcl::Option<Error> send_smth_for(NodeId node, ISender* sender);
 
     void sync_log_and_nodes();
+    /** Tells the leader that the storage made more of its entries durable, which may commit them.
+     * Storage which flushes asynchronously reports a completed flush to IStorage::set_durable_handler,
+     * which should post this call to the thread of the server. Without it the progress is noticed by tick. */
+    void durable_idx_advanced();
 
 private:
-    bmcl::Result<MsgAddEntryRep, Error> accept_entry(const Entry& ety);
+    bmcl::Result<MsgAddEntryRep, Error> accept_entry(Entry&& ety);
+    /** Adds entries just appended by the leader to the batching window, sends them once it is full */
+    void hold_proposals(Index first_idx, Index count, std::size_t bytes);
+    /** Empties the batching window without sending anything */
+    void drop_proposals();
+    /** Restores the configuration from the log and snapshot recovered by the storage, false if it wasn't recovered */
+    bool recover();
     bmcl::Option<Error> set_current_term(TermId term);
     bmcl::Option<Error> vote_for_nodeid(NodeId nodeid);
     void become_follower();
@@ -90,20 +148,41 @@ private:
     void set_state(State state);
 
     bool should_grant_vote(const MsgVoteReq& vr) const;
-    MsgAppendEntriesRep prepare_response(NodeId nodeid, bool success, Index index);
+    MsgAppendEntriesRep prepare_response(NodeId nodeid, bool success, Index index, TermId conflict_term = 0, Index conflict_idx = 0);
     MsgVoteRep prepare_requestvote_response_t(NodeId candidate, ReqVoteState vote);
     bmcl::Option<Error> send_appendentries(Node& node, ISender* sender);
+    bmcl::Option<Error> send_snapshot(Node& node, ISender* sender);
+    MsgInstallSnapshotRep prepare_snapshot_response(NodeId nodeid, Index last_idx, std::size_t offset, bool done);
+    bmcl::Option<Error> install_snapshot(const Snapshot& snapshot);
     bmcl::Option<Error> send_reqvote(Node& node, ISender* sender);
 
     void entry_pop(const Entry& ety);
-    bmcl::Option<Error> entry_push(const Entry& ety, bool needVoteChecks);
+    static void entry_revert(Nodes& nodes, const Entry& ety);
+    bmcl::Option<Error> entry_push(Entry&& ety, bool needVoteChecks);
+    void entry_cfg_change(const Entry& ety, Index idx);
     bmcl::Option<Error> entry_apply_one();
+    void update_commit_idx();
 
     bmcl::Option<NodeId>    _voted_for;      /**< The candidate the server voted for in its current term, or Nil if it hasn't voted for any.  */
     bmcl::Option<NodeId>    _current_leader; /**< what this node thinks is the node ID of the current leader, or -1 if there isn't a known current leader. */
     TermId                  _current_term;   /**< the server's best guess of what the current term is starts at zero */
     State                   _state;          /**< follower/leader/candidate indicator */
     Index                   _last_cfg_seen;
+    std::size_t             _snapshot_chunk_size;
+    Index                   _max_entries_per_append; /**< limits of a single AppendEntries, remaining entries are sent on its response */
+    std::size_t             _max_bytes_per_append;
+    std::size_t             _max_inflight_appends;
+    bool                    _entry_checksums;
+    bool                    _entry_poped_events;
+    Index                   _batch_max_count;   /**< thresholds of the proposal batching window */
+    std::size_t             _batch_max_bytes;
+    Time                    _batch_max_delay;
+    Index                   _batch_first_idx;   /**< first proposal held by the window, 0 if none */
+    Index                   _batch_count;
+    std::size_t             _batch_bytes;
+    Time                    _batch_age;         /**< time of the ticks since the first held proposal */
+    bmcl::Option<Snapshot>  _snapshot_rcv;   /**< snapshot being received from the leader */
+    std::vector<uint8_t>    _snapshot_rcv_data;
 
     Timer     _timer;
     Nodes     _nodes;
@@ -111,8 +190,10 @@ private:
     IStorage* _storage;
     ISender*  _sender;
     Applier   _applier;
+    SnapshotApplier _snapshot_applier;
     IEventHandler* _events;
     IEventHandler _defaultEventsHandler;
+    std::unique_ptr<ApplyThread> _apply_thread;
 
 };
 
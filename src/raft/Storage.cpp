@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <algorithm>
 #include "raft/Storage.h"
 
 
@@ -7,6 +8,24 @@ namespace raft
 
 IIndexAccess::~IIndexAccess() {}
 IStorage::~IStorage() {}
+bmcl::Option<Error> IStorage::sync() { return bmcl::None; }
+bmcl::Option<Error> IStorage::flush() { return sync(); }
+Index IStorage::get_durable_idx() const { return get_current_idx(); }
+void IStorage::set_durable_handler(const DurableHandler&) {}
+bmcl::Option<RecoveredState> IStorage::get_recovered() const { return bmcl::None; }
+bmcl::Option<Error> IStorage::push_back(Entry&& c) { return push_back(static_cast<const Entry&>(c)); }
+
+bmcl::Option<Error> IStorage::append_range(const DataHandler& entries)
+{
+    assert(entries.prev_log_idx() == get_current_idx());
+    for (Index idx = entries.prev_log_idx() + 1; idx <= entries.prev_log_idx() + entries.count(); ++idx)
+    {
+        bmcl::Option<Error> e = push_back(entries.get_at_idx(idx).unwrap());
+        if (e.isSome())
+            return e;
+    }
+    return bmcl::None;
+}
 
 DataHandler::DataHandler() : _ptr((const Entry*)nullptr), _prev_log_idx(0), _count(0){}
 DataHandler::DataHandler(const Entry* first_entry, Index prev_log_idx, Index count) : _ptr(first_entry), _prev_log_idx(prev_log_idx), _count(count) {}
@@ -32,7 +51,146 @@ bmcl::Option<const Entry&> DataHandler::get_at_idx(Index idx) const
 }
 
 
-MemStorage::MemStorage(): _base(0), _term(0) { }
+DataHandler DataHandler::tail(Index prev_log_idx) const
+{
+    if (prev_log_idx <= _prev_log_idx)
+        return *this;
+    Index skip = std::min(prev_log_idx - _prev_log_idx, _count);
+    if (_ptr.isFirst())
+        return DataHandler(_ptr.unwrapFirst(), _prev_log_idx + skip, _count - skip);
+    return DataHandler(_ptr.unwrapSecond() + skip, _prev_log_idx + skip, _count - skip);
+}
+
+
+bmcl::Option<TermId> IStorage::get_term_at_idx(Index idx) const
+{
+    if (idx > 0 && idx == get_base_idx())
+        return get_base_term();
+    const auto& ety = get_at_idx(idx);
+    if (ety.isNone())
+        return bmcl::None;
+    return ety->term();
+}
+
+Index IStorage::get_first_idx_of_term(Index idx) const
+{
+    bmcl::Option<TermId> term = get_term_at_idx(idx);
+    if (term.isNone())
+        return idx;
+    Index base = get_base_idx();
+    while (idx - 1 > base && get_term_at_idx(idx - 1) == term)
+        --idx;
+    return idx;
+}
+
+bmcl::Option<Index> IStorage::get_last_idx_of_term(TermId term, Index max_idx) const
+{
+    Index base = get_base_idx();
+    for (Index idx = std::min(max_idx, get_current_idx()); idx >= base && idx > 0; --idx)
+    {
+        TermId t = get_term_at_idx(idx).unwrap();
+        if (t == term)
+            return idx;
+        if (t < term)
+            break;
+    }
+    return bmcl::None;
+}
+
+bmcl::Option<Error> IStorage::truncate_from(Index idx)
+{
+    idx = std::max(idx, get_base_idx() + 1);
+    while (get_current_idx() >= idx)
+    {
+        bmcl::Result<Entry, Error> r = pop_back();
+        if (r.isErr())
+            return r.unwrapErr();
+    }
+    return bmcl::None;
+}
+
+void TermIndex::append(Index idx, TermId term)
+{
+    assert(_runs.empty() || _runs.back().first < idx);
+    if (_runs.empty() || _runs.back().term != term)
+        _runs.emplace_back(idx, term);
+}
+
+std::size_t TermIndex::find(Index idx) const
+{
+    assert(!_runs.empty() && _runs.front().first <= idx);
+    auto i = std::upper_bound(_runs.begin(), _runs.end(), idx, [](Index idx, const Run& r) { return idx < r.first; });
+    return (std::size_t)(i - _runs.begin()) - 1;
+}
+
+void TermIndex::truncate_from(Index idx)
+{
+    while (!_runs.empty() && _runs.back().first >= idx)
+        _runs.pop_back();
+}
+
+void TermIndex::drop_before(Index idx)
+{
+    if (_runs.empty() || idx <= _runs.front().first)
+        return;
+    std::size_t i = find(idx);
+    _runs.erase(_runs.begin(), _runs.begin() + i);
+    _runs.front().first = idx;
+}
+
+TermId TermIndex::get_term_at_idx(Index idx) const
+{
+    return _runs[find(idx)].term;
+}
+
+Index TermIndex::get_first_idx_of_term(Index idx) const
+{
+    return _runs[find(idx)].first;
+}
+
+bmcl::Option<Index> TermIndex::get_last_idx_of_term(TermId term, Index max_idx) const
+{
+    if (_runs.empty() || max_idx < _runs.front().first)
+        return bmcl::None;
+    /* last run not after max_idx which has a term not above the wanted one */
+    auto end = _runs.begin() + find(max_idx) + 1;
+    auto i = std::upper_bound(_runs.begin(), end, term, [](TermId term, const Run& r) { return term < r.term; });
+    if (i == _runs.begin())
+        return bmcl::None;
+    --i;
+    if (i->term != term)
+        return bmcl::None;
+    if (i + 1 == end)
+        return max_idx;
+    return (i + 1)->first - 1;
+}
+
+
+MemStorage::MemStorage(): _base(0), _term(0), _arena_max_payload(0) { }
+
+void MemStorage::set_arena(std::size_t chunk_size, std::size_t max_payload)
+{
+    if (chunk_size == 0)
+        _arena.clear();
+    else
+        _arena = Arena(chunk_size);
+    _arena_max_payload = max_payload;
+}
+
+bmcl::Option<Arena::Stats> MemStorage::get_arena_stats() const
+{
+    if (_arena.isNone())
+        return bmcl::None;
+    return _arena->stats();
+}
+
+Entry MemStorage::place(const Entry& ety)
+{
+    if (_arena.isNone() || !ety.isUser() || ety.size() == 0 || ety.size() > _arena_max_payload)
+        return ety;
+    const Buffer& data = ety.getUserData()->data;
+    return ety.rebind(_arena->copy(data.data(), data.size()));
+}
 
 Index MemStorage::count() const
 {
@@ -51,25 +209,46 @@ Index MemStorage::get_current_idx() const
 
 bmcl::Option<Error> MemStorage::push_back(const Entry& c)
 {
-    _entries.emplace_back(c);
+    _terms.append(get_current_idx() + 1, c.term());
+    _entries.emplace_back(place(c));
+    return bmcl::None;
+}
+
+bmcl::Option<Error> MemStorage::push_back(Entry&& c)
+{
+    _terms.append(get_current_idx() + 1, c.term());
+    if (_arena.isSome())
+        _entries.emplace_back(place(c));
+    else
+        _entries.emplace_back(std::move(c));
     return bmcl::None;
 }
 
-DataHandler MemStorage::get_from_idx(Index idx) const
+DataHandler MemStorage::get_from_idx(Index idx, Index max_count, std::size_t max_bytes) const
 {
-    assert(idx > _base);
     /* idx starts at 1 */
 
-    if (idx <= _base || idx > get_current_idx())
+    if (idx <= _base || idx > get_current_idx() || max_count == 0)
         return DataHandler((IStorage*)this, idx - 1, Index(0));
 
     Index i = idx - _base - 1;
-    return DataHandler((IStorage*)this, idx - 1, Index( _entries.size() - i));
+    Index count = std::min<Index>(_entries.size() - i, max_count);
+    if (max_bytes == std::size_t(-1))
+        return DataHandler((IStorage*)this, idx - 1, count);
+
+    std::size_t bytes = _entries[i].size();
+    Index n = 1;
+    for (; n < count; ++n)
+    {
+        bytes += _entries[i + n].size();
+        if (bytes > max_bytes)
+            break;
+    }
+    return DataHandler((IStorage*)this, idx - 1, n);
 }
 
 bmcl::Option<const Entry&> MemStorage::get_at_idx(Index idx) const
 {
-    assert(idx > _base);
     /* idx starts at 1 */
 
     if (idx <= _base || idx > get_current_idx())
@@ -79,15 +258,45 @@ bmcl::Option<const Entry&> MemStorage::get_at_idx(Index idx) const
     return _entries[i];
 }
 
-bmcl::Option<Entry> MemStorage::pop_back()
+bmcl::Option<Error> MemStorage::append_range(const DataHandler& entries)
 {
-    if (_entries.empty())
+    assert(entries.prev_log_idx() == get_current_idx());
+    for (Index idx = entries.prev_log_idx() + 1; idx <= entries.prev_log_idx() + entries.count(); ++idx)
+    {
+        const Entry& ety = entries.get_at_idx(idx).unwrap();
+        _terms.append(idx, ety.term());
+        _entries.emplace_back(place(ety));
+    }
+    return bmcl::None;
+}
+
+bmcl::Option<Error> MemStorage::truncate_from(Index idx)
+{
+    idx = std::max(idx, _base + 1);
+    if (idx > get_current_idx())
         return bmcl::None;
-    Entry ety = _entries.back();
+    _entries.erase(_entries.begin() + (idx - _base - 1), _entries.end());
+    _terms.truncate_from(idx);
+    return bmcl::None;
+}
+
+bmcl::Result<Entry, Error> MemStorage::pop_back()
+{
+    if (_entries.empty())
+        return Error::NothingToPop;
+    Entry ety = std::move(_entries.back());
     _entries.pop_back();
+    _terms.truncate_from(get_current_idx() + 1);
     return ety;
 }
 
+void MemStorage::rebind_payload(Index idx, const Buffer& data)
+{
+    assert(idx > _base && idx <= get_current_idx());
+    Entry& ety = _entries[idx - _base - 1];
+    ety = ety.rebind(data);
+}
+
 bmcl::Option<const Entry&> MemStorage::back() const
 {
     if (_entries.empty())
@@ -95,6 +304,76 @@ bmcl::Option<const Entry&> MemStorage::back() const
     return _entries.back();
 }
 
+TermId MemStorage::get_base_term() const
+{
+    if (_snapshot.isNone())
+        return TermId(0);
+    return _snapshot->last_term;
+}
+
+bmcl::Option<TermId> MemStorage::get_term_at_idx(Index idx) const
+{
+    if (idx > 0 && idx == _base)
+        return get_base_term();
+    if (idx <= _base || idx > get_current_idx())
+        return bmcl::None;
+    return _terms.get_term_at_idx(idx);
+}
+
+Index MemStorage::get_first_idx_of_term(Index idx) const
+{
+    if (idx <= _base || idx > get_current_idx())
+        return idx;
+    return _terms.get_first_idx_of_term(idx);
+}
+
+bmcl::Option<Index> MemStorage::get_last_idx_of_term(TermId term, Index max_idx) const
+{
+    max_idx = std::min(max_idx, get_current_idx());
+    if (max_idx > _base)
+    {
+        bmcl::Option<Index> idx = _terms.get_last_idx_of_term(term, max_idx);
+        if (idx.isSome() || _terms.get_term_at_idx(_base + 1) < term)
+            return idx;
+    }
+    if (_base > 0 && max_idx >= _base && get_base_term() == term)
+        return _base;
+    return bmcl::None;
+}
+
+bmcl::Option<const Snapshot&> MemStorage::get_snapshot() const
+{
+    if (_snapshot.isNone())
+        return bmcl::None;
+    return _snapshot.unwrap();
+}
+
+bmcl::Option<Error> MemStorage::persist_snapshot(const Snapshot& snapshot)
+{
+    if (snapshot.last_idx < _base)
+        return bmcl::None;
+
+    bmcl::Option<const Entry&> last = get_at_idx(snapshot.last_idx);
+    bool matches = (snapshot.last_idx == _base && get_base_term() == snapshot.last_term) || (last.isSome() && last->term() == snapshot.last_term);
+    if (matches)
+    {
+        _entries.erase(_entries.begin(), _entries.begin() + (snapshot.last_idx - _base));
+        if (_entries.empty())
+            _terms.clear();
+        else
+            _terms.drop_before(snapshot.last_idx + 1);
+    }
+    else
+    {
+        _entries.clear();
+        _terms.clear();
+    }
+
+    _base = snapshot.last_idx;
+    _snapshot = snapshot;
+    return bmcl::None;
+}
+
 bmcl::Option<Error> MemStorage::persist_term_vote(TermId term, bmcl::Option<NodeId> vote)
 {
     assert(term >= _term);
@@ -1,15 +1,51 @@
 #pragma once
+#include <deque>
+#include <functional>
 #include <vector>
+#include <bmcl/Either.h>
 #include <bmcl/Option.h>
+#include <bmcl/Result.h>
 #include "raft/Error.h"
 #include "raft/Entry.h"
 #include "raft/Ids.h"
+#include "raft/Arena.h"
 
 namespace raft
 {
 
 class DataHandler;
 
+/** Gets the idx the log became durable up to */
+using DurableHandler = std::function<void(Index durable_idx)>;
+
+struct SnapshotMember
+{
+    SnapshotMember(NodeId id, bool is_voting) : id(id), is_voting(is_voting) {}
+    NodeId id;
+    bool   is_voting;
+};
+
+/** State machine image which replaces a prefix of the log */
+struct Snapshot
+{
+    Snapshot() : last_idx(0), last_term(0) {}
+    Index  last_idx;                        /**< index of the last entry replaced by the snapshot */
+    TermId last_term;                       /**< term of the last entry replaced by the snapshot */
+    std::vector<SnapshotMember> members;    /**< cluster configuration as of last_idx */
+    UserData data;                          /**< state machine image provided by the application */
+};
+
+/** What a durable storage found when it was opened */
+struct RecoveredState
+{
+    RecoveredState() : term(0), last_idx(0), segments(0), truncated_bytes(0) {}
+    TermId term;
+    bmcl::Option<NodeId> vote;
+    Index last_idx;                         /**< last entry of the log, or of the snapshot if the log is empty */
+    std::size_t segments;
+    uint64_t truncated_bytes;               /**< size of the torn tail which was cut off */
+};
+
 class IIndexAccess
 {
 public:
@@ -30,11 +66,58 @@ public:
     virtual bmcl::Option<Error> persist_term_vote(TermId term, bmcl::Option<NodeId> vote) = 0;
 
     virtual Index get_current_idx() const = 0;
-    virtual DataHandler get_from_idx(Index idx) const = 0;
+    /** Entries starting at idx, at most max_count of them and not more than max_bytes of payload.
+     * The first entry is always included, so a single entry larger than max_bytes still can be replicated. */
+    virtual DataHandler get_from_idx(Index idx, Index max_count = Index(-1), std::size_t max_bytes = std::size_t(-1)) const = 0;
     virtual bmcl::Option<const Entry&> back() const = 0;
 
+    /** Index and term of the last entry replaced by the snapshot, log starts right after it */
+    virtual Index get_base_idx() const = 0;
+    virtual TermId get_base_term() const = 0;
+    virtual bmcl::Option<const Snapshot&> get_snapshot() const = 0;
+
+    /** Term of the entry at idx or of the snapshot if idx is the base. By default these read the entries */
+    virtual bmcl::Option<TermId> get_term_at_idx(Index idx) const;
+    /** First idx of the run of entries which have the same term as the entry at idx */
+    virtual Index get_first_idx_of_term(Index idx) const;
+    /** Last idx not above max_idx holding an entry of the term, terms don't decrease along the log */
+    virtual bmcl::Option<Index> get_last_idx_of_term(TermId term, Index max_idx) const;
+
+    /** Keeps the snapshot and drops the entries up to snapshot.last_idx. Entries which follow it are kept only
+     * if the log has an entry at snapshot.last_idx with snapshot.last_term, otherwise the whole log is dropped. */
+    virtual bmcl::Option<Error> persist_snapshot(const Snapshot& snapshot) = 0;
+
     virtual bmcl::Option<Error> push_back(const Entry& c) = 0;
-    virtual bmcl::Option<Entry> pop_back() = 0;
+    /** Takes the entry over, by default it is copied by push_back(const Entry&) */
+    virtual bmcl::Option<Error> push_back(Entry&& c);
+    /** Removes the last entry, NothingToPop if the log is empty */
+    virtual bmcl::Result<Entry, Error> pop_back() = 0;
+
+    /** Appends every entry of the handler, which has to start right after the last entry of the log.
+     * On error the entries which were stored before it stay in the log. By default entries are pushed one by one. */
+    virtual bmcl::Option<Error> append_range(const DataHandler& entries);
+
+    /** Drops the entries starting at idx up to the end of the log, entries replaced by the snapshot stay.
+     * By default entries are popped one by one. */
+    virtual bmcl::Option<Error> truncate_from(Index idx);
+
+    /** Makes every change done since the previous call durable. Called by Server at the points where
+     * raft requires the log to be persisted, so a durable backend may delay its fsync until then. */
+    virtual bmcl::Option<Error> sync();
+
+    /** Starts making the changes durable without waiting for it, by default it is sync.
+     * Leader replicates its entries while they are flushed and counts only the durable ones as its own match. */
+    virtual bmcl::Option<Error> flush();
+    /** Last idx of the log which is durable, by default everything which was stored */
+    virtual Index get_durable_idx() const;
+    /** Storage which flushes on a thread of its own calls handler there when a flush completes. The handler should
+     * post Server::durable_idx_advanced to the thread of the server. By default flush is done when it returns,
+     * so the handler is never called */
+    virtual void set_durable_handler(const DurableHandler& handler);
+
+    /** Set if the storage was loaded from durable media, Server created over it restarts the member
+     * with the configuration kept in the log instead of creating a new one. None by default */
+    virtual bmcl::Option<RecoveredState> get_recovered() const;
 };
 
 class DataHandler
@@ -48,6 +131,8 @@ public:
     bool empty() const;
     Index prev_log_idx() const;
     bmcl::Option<const Entry&> get_at_idx(Index idx) const;
+    /** Entries of the handler which follow prev_log_idx */
+    DataHandler tail(Index prev_log_idx) const;
 
 private:
     bmcl::Either<const IIndexAccess*, const Entry*> _ptr;
@@ -55,6 +140,36 @@ private:
     Index _count;
 };
 
+/** Terms of the log kept as runs of entries with the same term, lookups are O(log runs) */
+class TermIndex
+{
+public:
+    void append(Index idx, TermId term);
+    /** forgets idx and everything after it */
+    void truncate_from(Index idx);
+    /** forgets everything before idx */
+    void drop_before(Index idx);
+    void clear() { _runs.clear(); }
+    inline std::size_t runs_count() const { return _runs.size(); }
+
+    /** the following expect idx to be one of the appended indexes */
+    TermId get_term_at_idx(Index idx) const;
+    Index get_first_idx_of_term(Index idx) const;
+    bmcl::Option<Index> get_last_idx_of_term(TermId term, Index max_idx) const;
+
+private:
+    struct Run
+    {
+        Run(Index first, TermId term) : first(first), term(term) {}
+        Index  first;
+        TermId term;
+    };
+    std::size_t find(Index idx) const;
+    std::vector<Run> _runs;
+};
+
+/** Log kept in memory. Entries live in a deque, so appending and dropping a prefix never moves the other entries:
+ * references returned by get_at_idx and DataHandler stay valid until their entry is removed */
 class MemStorage : public IStorage
 {
 public:
@@ -68,18 +183,44 @@ public:
     bool empty() const override;
     Index get_current_idx() const override;
     bmcl::Option<const Entry&> get_at_idx(Index idx) const override;
-    DataHandler get_from_idx(Index idx) const override;
+    DataHandler get_from_idx(Index idx, Index max_count, std::size_t max_bytes) const override;
     bmcl::Option<const Entry&> back() const override;
 
+    Index get_base_idx() const override { return _base; }
+    TermId get_base_term() const override;
+    bmcl::Option<const Snapshot&> get_snapshot() const override;
+    bmcl::Option<TermId> get_term_at_idx(Index idx) const override;
+    Index get_first_idx_of_term(Index idx) const override;
+    bmcl::Option<Index> get_last_idx_of_term(TermId term, Index max_idx) const override;
+    inline const TermIndex& terms() const { return _terms; }
+    bmcl::Option<Error> persist_snapshot(const Snapshot& snapshot) override;
+
     bmcl::Option<Error> push_back(const Entry& c) override;
-    bmcl::Option<Entry> pop_back() override;
+    bmcl::Option<Error> push_back(Entry&& c) override;
+    bmcl::Result<Entry, Error> pop_back() override;
+    bmcl::Option<Error> append_range(const DataHandler& entries) override;
+    bmcl::Option<Error> truncate_from(Index idx) override;
+
+    /** Makes the user entry at idx refer to the same bytes kept elsewhere, e.g. in a mapped file */
+    void rebind_payload(Index idx, const Buffer& data);
+
+    /** Payloads up to max_payload bytes are copied into an arena of chunk_size chunks instead of keeping
+     * an allocation each, chunk_size 0 turns it off. Off by default, payloads are shared with the caller then */
+    void set_arena(std::size_t chunk_size, std::size_t max_payload = 1024);
+    bmcl::Option<Arena::Stats> get_arena_stats() const;
 
 private:
+    Entry place(const Entry& ety);
+
     TermId _term;
     bmcl::Option<NodeId> _vote;
 
     Index _base;
-    std::vector<Entry> _entries;
+    std::deque<Entry> _entries;
+    TermIndex _terms;
+    bmcl::Option<Snapshot> _snapshot;
+    bmcl::Option<Arena> _arena;
+    std::size_t _arena_max_payload;
 };
 
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 
 #pragma once
 #include <bmcl/Option.h>
+#include <bmcl/ArrayView.h>
 #include "raft/Ids.h"
 #include "raft/Entry.h"
 #include "raft/Error.h"
@@ -37,6 +38,23 @@ struct MsgAddEntryRep
     Index   idx;    /**< the entry's index */
 };
 
+/** Command of a client for Server::add_entries */
+struct Proposal
+{
+    Proposal(EntryId id, const UserData& data) : id(id), data(data) {}
+    EntryId  id;
+    UserData data;
+};
+
+/** Indexes the leader assigned to a batch of proposals, last_idx < first_idx if the batch was empty */
+struct MsgAddEntriesRep
+{
+    MsgAddEntriesRep(TermId term, Index first_idx, Index last_idx) : term(term), first_idx(first_idx), last_idx(last_idx) {}
+    TermId  term;
+    Index   first_idx;
+    Index   last_idx;
+};
+
 /** Vote request message.
  * Sent to nodes when a server wants to become leader.
  * This message could force a leader/candidate to become a follower. */
@@ -84,8 +102,8 @@ struct MsgAppendEntriesReq
  * This message could force a leader/candidate to become a follower. */
 struct MsgAppendEntriesRep
 {
-    MsgAppendEntriesRep(TermId term, bool success, Index current_idx)
-        : term(term), success(success), current_idx(current_idx) {}
+    MsgAppendEntriesRep(TermId term, bool success, Index current_idx, TermId conflict_term = 0, Index conflict_idx = 0)
+        : term(term), success(success), current_idx(current_idx), conflict_term(conflict_term), conflict_idx(conflict_idx) {}
     TermId term;           /**< currentTerm, to force other leader/candidate to step down */
     bool success;               /**< true if follower contained entry matching prevLogidx and prevLogTerm */
 
@@ -93,8 +111,41 @@ struct MsgAppendEntriesRep
     /* Having the following fields allows us to do less book keeping in regards to full fledged RPC */
 
     Index current_idx;    /**< This is the highest log IDX we've received and appended to our log */
+    TermId conflict_term; /**< term of the entry at prevLogIdx if it didn't match prevLogTerm, 0 otherwise */
+    Index conflict_idx;   /**< first idx of conflict_term in our log */
 } ;
 
+/** Install snapshot message.
+ * Sent instead of appendentries to a node which needs entries already replaced by the snapshot.
+ * Snapshot data is split into chunks, the next chunk is sent after the previous one is acknowledged.
+ * This message could force a leader/candidate to become a follower. */
+struct MsgInstallSnapshotReq
+{
+    MsgInstallSnapshotReq(TermId term, Index last_idx, TermId last_term, std::size_t offset, bool done,
+                          bmcl::ArrayView<uint8_t> chunk, bmcl::ArrayView<SnapshotMember> members)
+        : term(term), last_idx(last_idx), last_term(last_term), offset(offset), done(done), chunk(chunk), members(members) {}
+    TermId      term;           /**< currentTerm, to force other leader/candidate to step down */
+    Index       last_idx;       /**< the snapshot replaces all entries up through and including this index */
+    TermId      last_term;      /**< term of last_idx */
+    std::size_t offset;         /**< byte offset where chunk is positioned in the snapshot data */
+    bool        done;           /**< true if this is the last chunk */
+
+    bmcl::ArrayView<uint8_t> chunk;
+    bmcl::ArrayView<SnapshotMember> members;    /**< cluster configuration as of last_idx */
+};
+
+/** Install snapshot response message.
+ * Tells the leader which offset to continue from, so an interrupted transfer is resumed, not restarted. */
+struct MsgInstallSnapshotRep
+{
+    MsgInstallSnapshotRep(TermId term, Index last_idx, std::size_t offset, bool done)
+        : term(term), last_idx(last_idx), offset(offset), done(done) {}
+    TermId      term;           /**< currentTerm, for leader to update itself */
+    Index       last_idx;       /**< snapshot this response is for */
+    std::size_t offset;         /**< bytes of snapshot data received so far */
+    bool        done;           /**< true if snapshot is installed */
+};
+
 class ISender
 {
 public:
@@ -105,6 +156,9 @@ public:
 
     /** Callback for sending appendentries messages */
     virtual bmcl::Option<Error> append_entries(const NodeId& node, const MsgAppendEntriesReq& msg) = 0;
+
+    /** Callback for sending install snapshot messages */
+    virtual bmcl::Option<Error> install_snapshot(const NodeId& node, const MsgInstallSnapshotReq& msg) = 0;
 };
 
 class IEventHandler
@@ -122,15 +176,25 @@ public:
     virtual void rcvd(NodeId from, const MsgAppendEntriesRep&) {}
     virtual void rcvd(NodeId from, const MsgVoteReq&) {}
     virtual void rcvd(NodeId from, const MsgVoteRep&) {}
+    virtual void rcvd(NodeId from, const MsgInstallSnapshotReq&) {}
+    virtual void rcvd(NodeId from, const MsgInstallSnapshotRep&) {}
 
     virtual void send(NodeId to, const MsgAppendEntriesReq&) {}
     virtual void send(NodeId to, const MsgAppendEntriesRep&) {}
     virtual void send(NodeId to, const MsgVoteReq&) {}
     virtual void send(NodeId to, const MsgVoteRep&) {}
+    virtual void send(NodeId to, const MsgInstallSnapshotReq&) {}
+    virtual void send(NodeId to, const MsgInstallSnapshotRep&) {}
 
     virtual void entry_rcvd(const Entry&) {}
     virtual void entry_stored(Index entry_idx, const Entry&) {}
+    /** Fires only if Server::set_entry_poped_events is on, for every dropped entry before entries_truncated */
     virtual void entry_poped(Index entry_idx, const Entry&) {}
+    virtual void entries_truncated(Index first_idx, Index last_idx) {}
+    /** With the apply thread it fires once the entry is handed to the thread, see Server::get_applied_idx */
     virtual void entry_applied(Index entry_idx, const Entry&) {}
+    virtual void snapshot_installed(const Snapshot&) {}
+    /** Server was created over the state which the storage recovered */
+    virtual void recovered(TermId term, bmcl::Option<NodeId> vote, Index last_idx) {}
 };
 }
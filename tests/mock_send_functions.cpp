@@ -13,6 +13,11 @@ bmcl::Option<Error> Sender::append_entries(const NodeId& node, const MsgAppendEn
     return _ex->append_entries_req(_r, node, msg);
 }
 
+bmcl::Option<Error> Sender::install_snapshot(const NodeId& node, const MsgInstallSnapshotReq& msg)
+{
+    return _ex->install_snapshot_req(_r, node, msg);
+}
+
 void Exchanger::add(raft::Server* r)
 {
     sender_t s(this, r);
@@ -75,6 +80,11 @@ bmcl::Option<raft::Error> Exchanger::append_entries_rep(const raft::NodeId& from
     return __append_msg(from, to, &msg, sizeof(msg), raft_message_type_e::RAFT_MSG_APPENDENTRIES_RESPONSE);
 }
 
+bmcl::Option<raft::Error> Exchanger::install_snapshot_req(const raft::Server* from, const raft::NodeId& to, const MsgInstallSnapshotReq& msg)
+{
+    return __append_msg(from->nodes().get_my_id(), to, &msg, sizeof(msg), raft_message_type_e::RAFT_MSG_INSTALLSNAPSHOT);
+}
+
 bmcl::Option<msg_t> Exchanger::poll_msg_data(const raft::Server& from)
 {
     return poll_msg_data(from.nodes().get_my_id());
@@ -137,6 +147,19 @@ void Exchanger::poll_msgs(raft::NodeId from)
             EXPECT_EQ(sizeof(MsgVoteRep), m.data.size());
             s.raft->accept_rep(m.sender, *(MsgVoteRep*)m.data.data());
             break;
+        case raft_message_type_e::RAFT_MSG_INSTALLSNAPSHOT:
+        {
+            EXPECT_EQ(sizeof(MsgInstallSnapshotReq), m.data.size());
+            auto r = s.raft->accept_req(m.sender, *(MsgInstallSnapshotReq*)m.data.data());
+            EXPECT_TRUE(r.isOk());
+            MsgInstallSnapshotRep response = r.unwrap();
+            __append_msg(me, m.sender, &response, sizeof(response), raft_message_type_e::RAFT_MSG_INSTALLSNAPSHOT_RESPONSE);
+        }
+        break;
+        case raft_message_type_e::RAFT_MSG_INSTALLSNAPSHOT_RESPONSE:
+            EXPECT_EQ(sizeof(MsgInstallSnapshotRep), m.data.size());
+            s.raft->accept_rep(m.sender, *(MsgInstallSnapshotRep*)m.data.data());
+            break;
         }
     }
     s.inbox.clear();
@@ -12,6 +12,8 @@ enum class raft_message_type_e
     RAFT_MSG_REQUESTVOTE_RESPONSE,
     RAFT_MSG_APPENDENTRIES,
     RAFT_MSG_APPENDENTRIES_RESPONSE,
+    RAFT_MSG_INSTALLSNAPSHOT,
+    RAFT_MSG_INSTALLSNAPSHOT_RESPONSE,
 };
 
 struct msg_t
@@ -33,6 +35,12 @@ struct msg_t
         EXPECT_EQ(data.size(), sizeof(MsgAppendEntriesReq));
         return (MsgAppendEntriesReq*)data.data();
     }
+    bmcl::Option<MsgInstallSnapshotReq*> cast_to_installsnapshot()
+    {
+        EXPECT_EQ(raft_message_type_e::RAFT_MSG_INSTALLSNAPSHOT, type);
+        EXPECT_EQ(data.size(), sizeof(MsgInstallSnapshotReq));
+        return (MsgInstallSnapshotReq*)data.data();
+    }
     std::vector<uint8_t> data;
     /* what type of message is it? */
     raft_message_type_e type;
@@ -51,6 +59,7 @@ public:
     explicit Sender(Exchanger* ex, raft::Server* r);
     bmcl::Option<Error> request_vote(const NodeId& node, const MsgVoteReq& msg) override;
     bmcl::Option<Error> append_entries(const NodeId& node, const MsgAppendEntriesReq& msg) override;
+    bmcl::Option<Error> install_snapshot(const NodeId& node, const MsgInstallSnapshotReq& msg) override;
 };
 
 class Exchanger
@@ -67,6 +76,7 @@ public:
     bmcl::Option<raft::Error> request_vote_rep(const raft::NodeId& from, const raft::NodeId& to, const MsgVoteRep& msg);
     bmcl::Option<raft::Error> append_entries_req(const raft::Server* raft, const raft::NodeId& node, const MsgAppendEntriesReq& msg);
     bmcl::Option<raft::Error> append_entries_rep(const raft::NodeId& from, const raft::NodeId& to, const MsgAppendEntriesRep& msg);
+    bmcl::Option<raft::Error> install_snapshot_req(const raft::Server* raft, const raft::NodeId& node, const MsgInstallSnapshotReq& msg);
 
 private:
 
@@ -1,6 +1,15 @@
+#include <chrono>
 #include <deque>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include "raft/Committer.h"
+#include "raft/FileStorage.h"
 #include "mock_send_functions.h"
 
 using namespace raft;
@@ -165,6 +174,322 @@ TEST(TestMemStorage, cant_append_duplicates)
     EXPECT_EQ(1, s.count());
 }
 
+TEST(TestMemStorage, snapshot_drops_prefix_and_keeps_indexes)
+{
+    MemStorage s;
+    for (EntryId i = 1; i <= 5; ++i)
+        s.push_back(Entry(i, i, UserData()));
+
+    Snapshot snapshot;
+    snapshot.last_idx = 3;
+    snapshot.last_term = 3;
+    EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+
+    EXPECT_EQ(3, s.get_base_idx());
+    EXPECT_EQ(3, s.get_base_term());
+    EXPECT_EQ(2, s.count());
+    EXPECT_EQ(5, s.get_current_idx());
+    EXPECT_FALSE(s.get_at_idx(3).isSome());
+    EXPECT_EQ(4, s.get_at_idx(4)->id());
+    const IStorage& log = s;
+    EXPECT_EQ(2, log.get_from_idx(4).count());
+    EXPECT_EQ(5, log.get_from_idx(4).get_at_idx(5)->id());
+}
+
+TEST(TestMemStorage, stores_adopted_payload_without_copying)
+{
+    int deleted = 0;
+    uint8_t* buf = new uint8_t[4]{ 1, 2, 3, 4 };
+    {
+        MemStorage s;
+        s.push_back(Entry(1, 1, UserData(buf, 4, [&deleted](const uint8_t* p) { ++deleted; delete[] p; })));
+        EXPECT_EQ(buf, s.get_at_idx(1)->getUserData()->data.data());
+        EXPECT_EQ(std::vector<uint8_t>({ 1, 2, 3, 4 }), s.get_at_idx(1)->getUserData()->data);
+
+        bmcl::Result<Entry, Error> ety = s.pop_back();
+        ASSERT_TRUE(ety.isOk());
+        EXPECT_EQ(buf, ety.unwrap().getUserData()->data.data());
+        EXPECT_EQ(0, deleted);
+        ASSERT_TRUE(s.pop_back().isErr());
+        EXPECT_EQ(Error::NothingToPop, s.pop_back().unwrapErr());
+    }
+    EXPECT_EQ(1, deleted);
+}
+
+TEST(TestMemStorage, append_range_appends_tail_of_batch)
+{
+    MemStorage s;
+    s.push_back(Entry(1, 1, UserData()));
+    Entry entries[] = { Entry(1, 1, UserData()), Entry(1, 2, UserData()), Entry(1, 3, UserData()) };
+    DataHandler batch(entries, 0, 3);
+    EXPECT_TRUE(s.append_range(batch.tail(1)).isNone());
+    EXPECT_EQ(3, s.count());
+    EXPECT_EQ(3, s.back()->id());
+    EXPECT_EQ(0, batch.tail(5).count());
+}
+
+TEST(TestMemStorage, truncate_from_drops_tail)
+{
+    MemStorage s;
+    for (EntryId i = 1; i <= 5; ++i)
+        s.push_back(Entry(1, i, UserData()));
+    EXPECT_TRUE(s.truncate_from(6).isNone());
+    EXPECT_EQ(5, s.count());
+    EXPECT_TRUE(s.truncate_from(3).isNone());
+    EXPECT_EQ(2, s.count());
+    EXPECT_EQ(2, s.back()->id());
+}
+
+TEST(TestMemStorage, term_index_follows_the_log)
+{
+    MemStorage s;
+    const TermId terms[] = {1, 1, 2, 2, 2, 4, 5, 5};
+    for (EntryId i = 0; i < 8; ++i)
+        s.push_back(Entry(terms[i], i + 1, UserData()));
+    EXPECT_EQ(4, s.terms().runs_count());
+    EXPECT_EQ(2, s.get_term_at_idx(5).unwrap());
+    EXPECT_EQ(3, s.get_first_idx_of_term(5));
+    EXPECT_EQ(5, s.get_last_idx_of_term(2, 8).unwrap());
+    EXPECT_EQ(4, s.get_last_idx_of_term(2, 4).unwrap());
+    EXPECT_TRUE(s.get_last_idx_of_term(3, 8).isNone());
+    EXPECT_TRUE(s.get_term_at_idx(9).isNone());
+
+    s.pop_back();
+    EXPECT_TRUE(s.truncate_from(6).isNone());
+    EXPECT_EQ(2, s.terms().runs_count());
+    EXPECT_EQ(2, s.get_term_at_idx(5).unwrap());
+
+    Snapshot snapshot;
+    snapshot.last_idx = 4;
+    snapshot.last_term = 2;
+    EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+    EXPECT_EQ(1, s.terms().runs_count());
+    EXPECT_EQ(2, s.get_term_at_idx(4).unwrap());
+    EXPECT_EQ(5, s.get_first_idx_of_term(5));
+    EXPECT_EQ(5, s.get_last_idx_of_term(2, 8).unwrap());
+    EXPECT_TRUE(s.get_last_idx_of_term(1, 8).isNone());
+}
+
+TEST(TestEntry, is_compact_and_keeps_its_kind_across_copies)
+{
+    static_assert(sizeof(void*) != 8 || sizeof(Entry) <= 48, "Entry has grown");
+
+    Entry user(2, 7, UserData("aaa", 4));
+    user.seal();
+    Entry internal = Entry::add_node(3, 8, NodeId(5));
+    Entry copy = user;
+    EXPECT_EQ(2, user.getUserData()->data.use_count());
+
+    copy = internal;
+    EXPECT_EQ(1, user.getUserData()->data.use_count());
+    ASSERT_TRUE(copy.isInternal());
+    EXPECT_EQ(NodeId(5), copy.getInternalData()->node);
+    EXPECT_TRUE(copy.checksum().isNone());
+
+    copy = std::move(user);
+    ASSERT_TRUE(copy.isUser());
+    EXPECT_EQ(Buffer("aaa", 4), copy.getUserData()->data);
+    EXPECT_TRUE(copy.checksum().isSome());
+    EXPECT_TRUE(copy.is_intact());
+    EXPECT_EQ(7, copy.id());
+}
+
+TEST(TestEntry, vector_moves_entries_when_it_grows)
+{
+    static_assert(std::is_nothrow_move_constructible<Entry>::value, "vector would copy entries");
+    static_assert(std::is_nothrow_move_assignable<Entry>::value, "entries are moved around the log");
+
+    std::vector<Entry> entries;
+    Entry first(1, 1, UserData("aaa", 4));
+    entries.push_back(first);
+    EXPECT_EQ(2, first.getUserData()->data.use_count());
+    for (EntryId i = 2; i <= 100; ++i)
+        entries.push_back(Entry(1, i, UserData("bbb", 4)));
+    EXPECT_EQ(2, first.getUserData()->data.use_count());
+
+    first = entries[1];
+    EXPECT_EQ(1, entries[0].getUserData()->data.use_count());
+    EXPECT_EQ(2, entries[1].getUserData()->data.use_count());
+}
+
+TEST(TestEntry, packer_rejects_payload_over_4gib)
+{
+    CommandPacker packer;
+    EXPECT_TRUE(packer.add("aa", 2).isNone());
+    /* the size is checked before the bytes are read */
+    EXPECT_EQ(Error::TooBig, packer.add("a", std::size_t(UINT32_MAX) - 8).unwrapOr(Error::Shutdown));
+    EXPECT_EQ(1, packer.count());
+}
+
+TEST(TestEntry, packed_commands_are_read_in_place)
+{
+    CommandPacker packer;
+    packer.add("key1=a", 6);
+    packer.add("", 0);
+    packer.add("key2=bb", 7);
+    EXPECT_EQ(3, packer.count());
+    UserData payload = packer.finish();
+    EXPECT_EQ(0, packer.count());
+    EXPECT_EQ(4 + 3 * 4 + 13, payload.data.size());
+
+    /* count and ends are little-endian whatever the byte order of the node */
+    const uint8_t layout[] = { 3, 0, 0, 0, 6, 0, 0, 0, 6, 0, 0, 0, 13, 0, 0, 0 };
+    EXPECT_EQ(0, memcmp(layout, payload.data.data(), sizeof(layout)));
+
+    Entry ety = Entry::user_packed(2, 7, payload);
+    ety.seal();
+    Entry copy = ety;
+    EXPECT_TRUE(copy.is_packed());
+    EXPECT_TRUE(copy.is_intact());
+    bmcl::Option<PackedCommands> cmds = copy.get_commands();
+    ASSERT_TRUE(cmds.isSome());
+    ASSERT_EQ(3, cmds->count());
+    EXPECT_EQ(Buffer("key1=a", 6), cmds->at(0));
+    EXPECT_TRUE(cmds->at(1).empty());
+    EXPECT_EQ(Buffer("key2=bb", 7), cmds->at(2));
+    EXPECT_EQ(payload.data.data() + 4 + 3 * 4 + 6, cmds->at(2).data());
+
+    /* a plain entry with the same bytes is a different entry */
+    Entry plain(2, 7, payload);
+    EXPECT_TRUE(plain.get_commands().isNone());
+    EXPECT_NE(plain.compute_checksum(), ety.compute_checksum());
+    EXPECT_TRUE(PackedCommands::parse(UserData("\x05\0\0\0", 4)).isNone());
+}
+
+TEST(TestCrc32c, matches_reference)
+{
+    EXPECT_EQ(0xe3069283u, crc32c("123456789", 9));
+    EXPECT_EQ(0u, crc32c(nullptr, 0));
+
+    /* bitwise reference over every length and alignment the fast paths split on */
+    uint8_t data[64];
+    for (std::size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i * 37 + 11);
+    for (std::size_t offset = 0; offset < 8; ++offset)
+    {
+        for (std::size_t size = 0; size + offset <= sizeof(data); ++size)
+        {
+            uint32_t crc = 0xffffffff;
+            for (std::size_t i = offset; i < offset + size; ++i)
+            {
+                crc ^= data[i];
+                for (int k = 0; k < 8; ++k)
+                    crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+            }
+            ASSERT_EQ(~crc, crc32c(data + offset, size));
+        }
+    }
+    EXPECT_EQ(crc32c(data, 64), crc32c(data + 20, 44, crc32c(data, 20)));
+}
+
+TEST(TestMemStorage, entries_stay_in_place_while_log_grows_and_shrinks)
+{
+    MemStorage s;
+    for (EntryId i = 1; i <= 10; ++i)
+        s.push_back(Entry(1, i, UserData()));
+    const Entry* fifth = &s.get_at_idx(5).unwrap();
+    const IStorage& log = s;
+    DataHandler batch = log.get_from_idx(5, 3);
+    const Entry* batch_first = &batch.get_at_idx(5).unwrap();
+
+    for (EntryId i = 11; i <= 100000; ++i)
+        s.push_back(Entry(1, i, UserData()));
+    Snapshot snapshot;
+    snapshot.last_idx = 4;
+    snapshot.last_term = 1;
+    EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+    EXPECT_TRUE(s.truncate_from(50).isNone());
+
+    EXPECT_EQ(fifth, &s.get_at_idx(5).unwrap());
+    EXPECT_EQ(fifth, batch_first);
+    EXPECT_EQ(5, fifth->id());
+}
+
+TEST(TestMemStorage, arena_keeps_small_payloads_in_chunks_released_with_prefix)
+{
+    MemStorage s;
+    s.set_arena(64, 16);
+    for (EntryId i = 1; i <= 8; ++i)
+        s.push_back(Entry(1, i, UserData("aaaaaaaaaaaaaaa", 16)));
+    s.push_back(Entry(1, 9, UserData(std::vector<uint8_t>(100, 'b'))));
+
+    /* four payloads a chunk, the big one is kept as it is */
+    Arena::Stats stats = s.get_arena_stats().unwrap();
+    EXPECT_EQ(8, stats.allocations);
+    EXPECT_EQ(128, stats.bytes);
+    EXPECT_EQ(2, stats.chunks_allocated);
+    EXPECT_EQ(0, stats.chunks_released);
+    EXPECT_EQ(s.get_at_idx(1)->getUserData()->data.data() + 16, s.get_at_idx(2)->getUserData()->data.data());
+    EXPECT_EQ(Buffer("aaaaaaaaaaaaaaa", 16), s.get_at_idx(8)->getUserData()->data);
+
+    Snapshot snapshot;
+    snapshot.last_idx = 5;
+    snapshot.last_term = 1;
+    EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+    EXPECT_EQ(1, s.get_arena_stats()->chunks_released);
+}
+
+TEST(TestMemStorage, get_from_idx_limits_count_and_bytes)
+{
+    MemStorage s;
+    for (EntryId i = 1; i <= 5; ++i)
+        s.push_back(Entry(1, i, UserData("aaaa", 4)));
+
+    const IStorage& log = s;
+    EXPECT_EQ(5, log.get_from_idx(1).count());
+    EXPECT_EQ(3, log.get_from_idx(1, 3).count());
+    EXPECT_EQ(2, log.get_from_idx(4, 3).count());
+    EXPECT_EQ(2, log.get_from_idx(1, 5, 11).count());
+    EXPECT_EQ(3, log.get_from_idx(1, 5, 12).count());
+    EXPECT_EQ(2, log.get_from_idx(1, 2, 12).count());
+
+    /* entry bigger than the limit is still returned alone */
+    EXPECT_EQ(1, log.get_from_idx(2, 5, 1).count());
+    EXPECT_EQ(2, log.get_from_idx(2, 5, 1).get_at_idx(2)->id());
+    EXPECT_EQ(0, log.get_from_idx(2, 0).count());
+}
+
+TEST(TestMemStorage, snapshot_not_matching_log_drops_everything)
+{
+    MemStorage s;
+    for (EntryId i = 1; i <= 5; ++i)
+        s.push_back(Entry(1, i, UserData()));
+
+    Snapshot snapshot;
+    snapshot.last_idx = 3;
+    snapshot.last_term = 2;
+    EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+    EXPECT_EQ(0, s.count());
+    EXPECT_EQ(3, s.get_current_idx());
+
+    s.push_back(Entry(2, 6, UserData()));
+    EXPECT_EQ(6, s.get_at_idx(4)->id());
+}
+
+TEST(TestLogCommitter, compact_remembers_term_of_last_applied_entry)
+{
+    MemStorage s;
+    s.push_back(Entry(1, 1, UserData()));
+    s.push_back(Entry(2, 2, UserData()));
+    s.push_back(Entry(3, 3, UserData()));
+
+    Committer lc(&s);
+    lc.set_commit_idx(2);
+    lc.entry_apply_one(__Applier);
+    lc.entry_apply_one(__Applier);
+    EXPECT_TRUE(lc.compact(UserData("state", 6), { SnapshotMember(NodeId(1), true) }).isNone());
+
+    EXPECT_EQ(2, lc.get_base_idx());
+    EXPECT_EQ(2, lc.get_term_at_idx(2).unwrap());
+    EXPECT_EQ(3, lc.get_term_at_idx(3).unwrap());
+    EXPECT_FALSE(lc.get_term_at_idx(1).isSome());
+    ASSERT_TRUE(s.get_snapshot().isSome());
+    EXPECT_EQ(UserData("state", 6).data, s.get_snapshot()->data.data);
+
+    s.pop_back();
+    EXPECT_EQ(2, lc.get_last_log_term().unwrap());
+}
+
 TEST(TestServer, apply_entry_increments_last_applied_idx)
 {
     MemStorage storage;
@@ -201,4 +526,499 @@ TEST(TestLogCommitter, wont_apply_entry_if_there_isnt_a_majority)
     /* Not allowed to be applied because we haven't confirmed a majority yet */
     EXPECT_EQ(0, lc.get_last_applied_idx());
     EXPECT_EQ(0, lc.get_commit_idx());
-}
\ No newline at end of file
+}
+
+class TestFileStorage : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        char tmpl[] = "/tmp/raftcpp-XXXXXX";
+        ASSERT_NE(nullptr, mkdtemp(tmpl));
+        dir = tmpl;
+    }
+
+    void TearDown() override
+    {
+        DIR* d = opendir(dir.c_str());
+        while (const dirent* i = readdir(d))
+            unlink((dir + "/" + i->d_name).c_str());
+        closedir(d);
+        rmdir(dir.c_str());
+    }
+
+    std::string dir;
+};
+
+TEST_F(TestFileStorage, entries_term_and_vote_survive_reopen)
+{
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        EXPECT_TRUE(s.persist_term_vote(3, NodeId(2)).isNone());
+        s.push_back(Entry(1, 1, UserData("aaa", 4)));
+        s.push_back(Entry::add_node(2, 2, NodeId(5)));
+        EXPECT_TRUE(s.sync().isNone());
+    }
+
+    FileStorage s(dir);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(3, s.term());
+    EXPECT_EQ(NodeId(2), s.vote());
+    ASSERT_EQ(2, s.get_current_idx());
+    EXPECT_EQ(UserData("aaa", 4).data, s.get_at_idx(1)->getUserData()->data);
+    EXPECT_EQ(2, s.get_at_idx(2)->term());
+    EXPECT_EQ(InternalData::AddNode, s.get_at_idx(2)->getInternalData()->type);
+    EXPECT_EQ(NodeId(5), s.get_at_idx(2)->getInternalData()->node);
+}
+
+TEST_F(TestFileStorage, damaged_records_are_detected_on_open)
+{
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 3; ++i)
+        {
+            Entry ety(1, i, UserData("aaa", 4));
+            ety.seal();
+            s.push_back(ety);
+        }
+        s.sync();
+    }
+
+    /* zeros the file was extended with are a torn tail */
+    std::string path = dir + "/00000000000000000001.log";
+    FILE* f = fopen(path.c_str(), "ab");
+    ASSERT_NE(nullptr, f);
+    char zeros[100] = {};
+    fwrite(zeros, 1, sizeof(zeros), f);
+    fclose(f);
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        EXPECT_EQ(3, s.get_current_idx());
+        ASSERT_TRUE(s.back()->checksum().isSome());
+        EXPECT_TRUE(s.back()->is_intact());
+        EXPECT_EQ(100, s.get_recovered()->truncated_bytes);
+    }
+
+    /* the last record is complete, it may have been acknowledged: a bad checksum is an error, not a torn tail */
+    f = fopen(path.c_str(), "r+b");
+    ASSERT_NE(nullptr, f);
+    fseek(f, -1, SEEK_END);
+    fputc('x', f);
+    fclose(f);
+    {
+        FileStorage s(dir);
+        EXPECT_EQ(Error::Corrupted, s.open().unwrapOr(Error::Shutdown));
+    }
+
+    /* as is a damaged record in the middle of the log */
+    f = fopen(path.c_str(), "r+b");
+    ASSERT_NE(nullptr, f);
+    fseek(f, -1, SEEK_END);
+    fputc('\0', f);
+    fseek(f, 40, SEEK_SET);
+    fputc('x', f);
+    fclose(f);
+    FileStorage s(dir);
+    EXPECT_EQ(Error::Corrupted, s.open().unwrapOr(Error::Shutdown));
+}
+
+TEST_F(TestFileStorage, packed_entries_survive_reopen)
+{
+    CommandPacker packer;
+    packer.add("aa", 2);
+    packer.add("bbb", 3);
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        s.push_back(Entry(1, 1, UserData("aaa", 4)));
+        s.push_back(Entry::user_packed(1, 2, packer.finish()));
+        s.sync();
+    }
+    FileStorage s(dir);
+    ASSERT_TRUE(s.open().isNone());
+    ASSERT_EQ(2, s.get_current_idx());
+    EXPECT_FALSE(s.get_at_idx(1)->is_packed());
+    bmcl::Option<PackedCommands> cmds = s.get_at_idx(2)->get_commands();
+    ASSERT_TRUE(cmds.isSome());
+    ASSERT_EQ(2, cmds->count());
+    EXPECT_EQ(Buffer("bbb", 3), cmds->at(1));
+}
+
+TEST_F(TestFileStorage, parallel_open_recovers_every_segment)
+{
+    {
+        FileStorage s(dir, 1);
+        ASSERT_TRUE(s.open().isNone());
+        EXPECT_TRUE(s.get_recovered().isNone());
+        ASSERT_TRUE(s.persist_term_vote(3, NodeId(2)).isNone());
+        for (EntryId i = 1; i <= 20; ++i)
+            s.push_back(Entry(1 + i / 8, i, UserData("aaa", 4)));
+        s.sync();
+    }
+
+    FILE* f = fopen((dir + "/00000000000000000020.log").c_str(), "ab");
+    ASSERT_NE(nullptr, f);
+    fwrite("\x40\0\0\0garbage", 1, 11, f);
+    fclose(f);
+
+    FileStorage s(dir, 1);
+    ASSERT_TRUE(s.open(4).isNone());
+    ASSERT_EQ(20, s.get_current_idx());
+    for (Index i = 1; i <= 20; ++i)
+        EXPECT_EQ(i, s.get_at_idx(i)->id());
+    EXPECT_EQ(8, s.get_first_idx_of_term(10));
+
+    bmcl::Option<RecoveredState> state = s.get_recovered();
+    ASSERT_TRUE(state.isSome());
+    EXPECT_EQ(3, state->term);
+    EXPECT_EQ(NodeId(2), state->vote.unwrap());
+    EXPECT_EQ(20, state->last_idx);
+    EXPECT_EQ(20, state->segments);
+    EXPECT_EQ(11, state->truncated_bytes);
+}
+
+TEST_F(TestFileStorage, one_sync_makes_many_entries_durable)
+{
+    FileStorage s(dir);
+    ASSERT_TRUE(s.open().isNone());
+    for (EntryId i = 1; i <= 10; ++i)
+        s.push_back(Entry(1, i, UserData("aaa", 4)));
+    EXPECT_EQ(10, s.unsynced_count());
+    EXPECT_TRUE(s.sync().isNone());
+    EXPECT_EQ(0, s.unsynced_count());
+}
+
+TEST_F(TestFileStorage, pop_back_survives_reopen_and_removes_empty_segments)
+{
+    {
+        FileStorage s(dir, 1);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 6; ++i)
+            s.push_back(Entry(1, i, UserData("aaaaaaaaaaaaaaa", 16)));
+        EXPECT_EQ(6, s.segments_count());
+        s.pop_back();
+        s.pop_back();
+        EXPECT_EQ(4, s.segments_count());
+        s.sync();
+    }
+
+    FileStorage s(dir, 1);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(4, s.get_current_idx());
+    EXPECT_EQ(4, s.back()->id());
+}
+
+TEST_F(TestFileStorage, pop_back_skips_empty_trailing_segment)
+{
+    {
+        FileStorage s(dir, 1);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 3; ++i)
+            s.push_back(Entry(1, i, UserData("aaa", 4)));
+        s.sync();
+    }
+
+    /* left by a failed write of the first record of a new segment */
+    FILE* f = fopen((dir + "/00000000000000000004.log").c_str(), "wb");
+    ASSERT_NE(nullptr, f);
+    fclose(f);
+
+    FileStorage s(dir, 1);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(3, s.get_current_idx());
+    EXPECT_EQ(4, s.segments_count());
+    bmcl::Result<Entry, Error> ety = s.pop_back();
+    ASSERT_TRUE(ety.isOk());
+    EXPECT_EQ(3, ety.unwrap().id());
+    EXPECT_EQ(2, s.get_current_idx());
+    EXPECT_EQ(2, s.segments_count());
+
+    s.push_back(Entry(1, 3, UserData("bbb", 4)));
+    EXPECT_TRUE(s.sync().isNone());
+    FileStorage s2(dir, 1);
+    ASSERT_TRUE(s2.open().isNone());
+    EXPECT_EQ(3, s2.get_current_idx());
+    EXPECT_EQ(UserData("bbb", 4).data, s2.get_at_idx(3)->getUserData()->data);
+}
+
+TEST_F(TestFileStorage, append_range_writes_batch_into_segments)
+{
+    Entry entries[] = { Entry(1, 1, UserData("aaaaaaaaaaaaaaa", 16)), Entry(1, 2, UserData("aaaaaaaaaaaaaaa", 16)),
+                        Entry(1, 3, UserData("aaaaaaaaaaaaaaa", 16)), Entry(1, 4, UserData("aaaaaaaaaaaaaaa", 16)),
+                        Entry::add_node(1, 5, NodeId(2)) };
+    {
+        /* three records fit into a segment */
+        FileStorage s(dir, 120);
+        ASSERT_TRUE(s.open().isNone());
+        EXPECT_TRUE(s.append_range(DataHandler(entries, 0, 5)).isNone());
+        EXPECT_EQ(5, s.get_current_idx());
+        EXPECT_EQ(5, s.unsynced_count());
+        EXPECT_EQ(2, s.segments_count());
+        s.sync();
+    }
+
+    FileStorage s(dir, 120);
+    ASSERT_TRUE(s.open().isNone());
+    ASSERT_EQ(5, s.get_current_idx());
+    for (Index i = 1; i <= 4; ++i)
+        EXPECT_EQ(i, s.get_at_idx(i)->id());
+    EXPECT_EQ(InternalData::AddNode, s.get_at_idx(5)->getInternalData()->type);
+}
+
+TEST_F(TestFileStorage, truncate_from_cuts_segments_and_survives_reopen)
+{
+    {
+        FileStorage s(dir, 120);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 8; ++i)
+            s.push_back(Entry(1, i, UserData("aaaaaaaaaaaaaaa", 16)));
+        EXPECT_EQ(3, s.segments_count());
+        EXPECT_TRUE(s.truncate_from(3).isNone());
+        EXPECT_EQ(2, s.get_current_idx());
+        EXPECT_EQ(1, s.segments_count());
+        s.push_back(Entry(2, 9, UserData("aaaaaaaaaaaaaaa", 16)));
+        s.sync();
+    }
+
+    FileStorage s(dir, 120);
+    ASSERT_TRUE(s.open().isNone());
+    ASSERT_EQ(3, s.get_current_idx());
+    EXPECT_EQ(9, s.back()->id());
+}
+
+TEST_F(TestFileStorage, sealed_segments_are_mapped_and_cut_safely)
+{
+    char payload[16] = "aaaaaaaaaaaaaa0";
+    {
+        FileStorage s(dir, 120);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 8; ++i)
+        {
+            payload[14] = (char)('0' + i);
+            s.push_back(Entry(1, i, UserData(payload, 16)));
+        }
+        EXPECT_EQ(3, s.segments_count());
+        EXPECT_EQ(2, s.mapped_count());
+        const IStorage& log = s;
+        EXPECT_EQ(7, log.get_from_idx(2).count());
+
+        /* a payload handed out stays readable after its segment is cut */
+        Buffer held = s.get_at_idx(5)->getUserData()->data;
+        EXPECT_TRUE(s.truncate_from(5).isNone());
+        EXPECT_EQ(2, s.segments_count());
+        EXPECT_EQ(1, s.mapped_count());
+        payload[14] = '5';
+        EXPECT_EQ(Buffer(payload, 16), held);
+
+        payload[14] = '9';
+        s.push_back(Entry(2, 9, UserData(payload, 16)));
+        s.sync();
+    }
+
+    FileStorage s(dir, 120);
+    ASSERT_TRUE(s.open().isNone());
+    ASSERT_EQ(5, s.get_current_idx());
+    EXPECT_EQ(1, s.mapped_count());
+    for (Index i = 1; i <= 5; ++i)
+    {
+        payload[14] = (char)('0' + (i < 5 ? i : 9));
+        EXPECT_EQ(Buffer(payload, 16), s.get_at_idx(i)->getUserData()->data);
+    }
+}
+
+TEST_F(TestFileStorage, flush_reports_durable_idx_when_done)
+{
+    FileStorage s(dir, 120);
+    ASSERT_TRUE(s.open().isNone());
+    for (EntryId i = 1; i <= 5; ++i)
+        s.push_back(Entry(1, i, UserData("aaaaaaaaaaaaaaa", 16)));
+    EXPECT_EQ(0, s.get_durable_idx());
+
+    ASSERT_TRUE(s.flush().isNone());
+    for (int i = 0; i < 1000 && s.get_durable_idx() < 5; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(5, s.get_durable_idx());
+
+    s.push_back(Entry(1, 6, UserData("aaaaaaaaaaaaaaa", 16)));
+    s.flush();
+    EXPECT_TRUE(s.truncate_from(4).isNone());
+    EXPECT_GE(3, s.get_durable_idx());
+    EXPECT_TRUE(s.sync().isNone());
+    EXPECT_EQ(3, s.get_durable_idx());
+}
+
+TEST_F(TestFileStorage, flush_during_running_flush_is_queued)
+{
+    FileStorage s(dir, 120);
+    ASSERT_TRUE(s.open().isNone());
+    for (EntryId i = 1; i <= 20; ++i)
+    {
+        s.push_back(Entry(1, i, UserData("aaaaaaaaaaaaaaa", 16)));
+        ASSERT_TRUE(s.flush().isNone());
+    }
+
+    /* no flush follows the last one, still every entry becomes durable */
+    for (int i = 0; i < 1000 && s.get_durable_idx() < 20; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(20, s.get_durable_idx());
+    EXPECT_EQ(0, s.unsynced_count());
+}
+
+TEST_F(TestFileStorage, torn_tail_is_cut_off)
+{
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        s.push_back(Entry(1, 1, UserData("aaa", 4)));
+        s.push_back(Entry(1, 2, UserData("bbb", 4)));
+        s.sync();
+    }
+
+    FILE* f = fopen((dir + "/00000000000000000001.log").c_str(), "ab");
+    ASSERT_NE(nullptr, f);
+    fwrite("\x40\0\0\0garbage", 1, 11, f);
+    fclose(f);
+
+    FileStorage s(dir);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(2, s.get_current_idx());
+    s.push_back(Entry(1, 3, UserData("ccc", 4)));
+    s.sync();
+
+    FileStorage s2(dir);
+    ASSERT_TRUE(s2.open().isNone());
+    EXPECT_EQ(3, s2.get_current_idx());
+    EXPECT_EQ(3, s2.back()->id());
+}
+
+TEST_F(TestFileStorage, torn_sealed_segment_ends_the_log)
+{
+    {
+        FileStorage s(dir, 1);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 5; ++i)
+            s.push_back(Entry(1, i, UserData("aaa", 4)));
+        s.sync();
+        ASSERT_EQ(5, s.segments_count());
+    }
+
+    /* a crash after rollovers: the third segment was never synced, the later ones were */
+    std::string path = dir + "/00000000000000000003.log";
+    struct stat st;
+    ASSERT_EQ(0, stat(path.c_str(), &st));
+    ASSERT_EQ(0, truncate(path.c_str(), st.st_size - 3));
+    {
+        FileStorage s(dir, 1);
+        ASSERT_TRUE(s.open().isNone());
+        EXPECT_EQ(2, s.get_current_idx());
+        EXPECT_EQ(3, s.segments_count());
+        EXPECT_NE(0, access((dir + "/00000000000000000004.log").c_str(), F_OK));
+        EXPECT_NE(0, access((dir + "/00000000000000000005.log").c_str(), F_OK));
+        s.push_back(Entry(2, 6, UserData("ccc", 4)));
+        s.sync();
+    }
+
+    /* a missing segment is a gap, the log ends in front of it */
+    ASSERT_EQ(0, unlink((dir + "/00000000000000000002.log").c_str()));
+    FileStorage s(dir, 1);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(1, s.get_current_idx());
+    EXPECT_EQ(1, s.segments_count());
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+}
+
+TEST_F(TestFileStorage, snapshot_removes_covered_segments_and_survives_reopen)
+{
+    {
+        FileStorage s(dir, 1);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 5; ++i)
+            s.push_back(Entry(1, i, UserData("aaa", 4)));
+        s.sync();
+
+        Snapshot snapshot;
+        snapshot.last_idx = 3;
+        snapshot.last_term = 1;
+        snapshot.members.emplace_back(NodeId(1), true);
+        snapshot.members.emplace_back(NodeId(2), false);
+        snapshot.data = UserData("state", 6);
+        EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+        EXPECT_EQ(2, s.segments_count());
+    }
+
+    FileStorage s(dir, 1);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(3, s.get_base_idx());
+    EXPECT_EQ(1, s.get_base_term());
+    EXPECT_EQ(5, s.get_current_idx());
+    EXPECT_EQ(4, s.get_at_idx(4)->id());
+    ASSERT_TRUE(s.get_snapshot().isSome());
+    EXPECT_EQ(UserData("state", 6).data, s.get_snapshot()->data.data);
+    ASSERT_EQ(2, s.get_snapshot()->members.size());
+    EXPECT_EQ(NodeId(2), s.get_snapshot()->members[1].id);
+    EXPECT_FALSE(s.get_snapshot()->members[1].is_voting);
+}
+
+TEST_F(TestFileStorage, snapshot_with_huge_members_count_is_rejected)
+{
+    /* members * 9 + 8 wraps around to 1 */
+    uint64_t header[4] = { 3, 1, 2049638230412172401ull, 0 };
+    FILE* f = fopen((dir + "/snapshot").c_str(), "wb");
+    ASSERT_NE(nullptr, f);
+    fwrite(header, 1, sizeof(header), f);
+    fclose(f);
+
+    FileStorage s(dir);
+    EXPECT_EQ(Error::CantStore, s.open().unwrapOr(Error::Shutdown));
+}
+
+TEST_F(TestFileStorage, conflicting_segments_left_by_snapshot_are_dropped_on_open)
+{
+    std::string path = dir + "/00000000000000000001.log";
+    std::vector<char> segment(4096);
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        for (EntryId i = 1; i <= 5; ++i)
+            s.push_back(Entry(1, i, UserData("aaa", 4)));
+        s.sync();
+
+        FILE* f = fopen(path.c_str(), "rb");
+        ASSERT_NE(nullptr, f);
+        segment.resize(fread(segment.data(), 1, segment.size(), f));
+        fclose(f);
+
+        Snapshot snapshot;
+        snapshot.last_idx = 3;
+        snapshot.last_term = 2;
+        snapshot.members.emplace_back(NodeId(1), true);
+        EXPECT_TRUE(s.persist_snapshot(snapshot).isNone());
+        EXPECT_EQ(0, s.segments_count());
+    }
+
+    /* crash after the snapshot was written but before the conflicting segment was removed */
+    FILE* f = fopen(path.c_str(), "wb");
+    ASSERT_NE(nullptr, f);
+    fwrite(segment.data(), 1, segment.size(), f);
+    fclose(f);
+
+    {
+        FileStorage s(dir);
+        ASSERT_TRUE(s.open().isNone());
+        EXPECT_EQ(3, s.get_base_idx());
+        EXPECT_EQ(3, s.get_current_idx());
+        EXPECT_EQ(0, s.segments_count());
+        EXPECT_TRUE(s.push_back(Entry(2, 4, UserData("bbb", 4))).isNone());
+        EXPECT_TRUE(s.sync().isNone());
+    }
+
+    FileStorage s(dir);
+    ASSERT_TRUE(s.open().isNone());
+    EXPECT_EQ(3, s.get_base_idx());
+    ASSERT_EQ(4, s.get_current_idx());
+    EXPECT_EQ(2, s.get_at_idx(4)->term());
+    EXPECT_EQ(UserData("bbb", 4).data, s.get_at_idx(4)->getUserData()->data);
+}
@@ -123,4 +123,152 @@ TEST(TestNode, Rediness)
 
     nodes.add_node(NodeId(3), true);
     EXPECT_TRUE(nodes.is_me_candidate_ready());
-}
\ No newline at end of file
+}
+
+TEST(TestNode, quorum_idx_is_matched_by_majority_of_voting_nodes)
+{
+    Nodes nodes(NodeId(1));
+    nodes.add_my_node(true);
+    for (std::size_t i = 2; i <= 5; ++i)
+        nodes.add_node(NodeId(i), true);
+    nodes.add_node(NodeId(6), false);
+    EXPECT_EQ(0, nodes.get_quorum_idx());
+
+    nodes.get_node(NodeId(1))->set_match_idx(5);
+    nodes.get_node(NodeId(2))->set_match_idx(4);
+    nodes.get_node(NodeId(6))->set_match_idx(5);
+    EXPECT_EQ(0, nodes.get_quorum_idx());
+
+    nodes.get_node(NodeId(3))->set_match_idx(2);
+    EXPECT_EQ(2, nodes.get_quorum_idx());
+    EXPECT_TRUE(nodes.is_committed(2));
+    EXPECT_FALSE(nodes.is_committed(3));
+
+    nodes.get_node(NodeId(4))->set_match_idx(4);
+    EXPECT_EQ(4, nodes.get_quorum_idx());
+
+    /* non voting node doesn't count */
+    nodes.get_node(NodeId(2))->set_voting(false);
+    EXPECT_EQ(2, nodes.get_quorum_idx());
+    nodes.get_node(NodeId(6))->set_voting(true);
+    EXPECT_EQ(4, nodes.get_quorum_idx());
+
+    nodes.remove_node(NodeId(4));
+    EXPECT_EQ(2, nodes.get_quorum_idx());
+
+    Nodes copy = nodes;
+    copy.get_node(NodeId(3))->set_match_idx(5);
+    EXPECT_EQ(5, copy.get_quorum_idx());
+    EXPECT_EQ(2, nodes.get_quorum_idx());
+}
+
+TEST(TestNode, node_references_stay_valid_while_nodes_change)
+{
+    Nodes nodes(NodeId(5));
+    Node& me = nodes.add_my_node(true);
+    Node& n = nodes.add_node(NodeId(7), false);
+    for (std::size_t i = 1; i <= 100; ++i)
+        if (i != 5 && i != 7)
+            nodes.add_node(NodeId(i), false);
+    nodes.remove_node(NodeId(6));
+
+    n.set_next_idx(42);
+    EXPECT_EQ(42, nodes.get_node(NodeId(7))->get_next_idx());
+    EXPECT_EQ(NodeId(5), me.get_id());
+    EXPECT_EQ(99, nodes.count());
+    EXPECT_EQ(NodeId(1), nodes.items().front().get_id());
+    EXPECT_EQ(NodeId(100), nodes.items().back().get_id());
+}
+
+TEST(TestNode, votes_and_commits_are_counted_over_voting_slots)
+{
+    Nodes nodes(NodeId(1));
+    nodes.add_my_node(true);
+    for (std::size_t i = 2; i <= 5; ++i)
+        nodes.add_node(NodeId(i), true);
+    nodes.add_node(NodeId(6), false);
+    EXPECT_EQ(5, nodes.get_num_voting_nodes());
+
+    /* my own flag and non voting nodes don't count as votes */
+    nodes.get_node(NodeId(1))->vote_for_me(true);
+    nodes.get_node(NodeId(2))->vote_for_me(true);
+    nodes.get_node(NodeId(6))->vote_for_me(true);
+    EXPECT_EQ(1, nodes.get_nvotes_for_me(bmcl::None));
+    EXPECT_EQ(2, nodes.get_nvotes_for_me(NodeId(1)));
+    nodes.get_node(NodeId(6))->set_voting(true);
+    EXPECT_EQ(3, nodes.get_nvotes_for_me(NodeId(1)));
+
+    /* a freed slot is reused and starts from the node's own state */
+    nodes.remove_node(NodeId(3));
+    nodes.add_node(NodeId(7), true);
+    EXPECT_EQ(6, nodes.get_num_voting_nodes());
+    EXPECT_EQ(3, nodes.get_nvotes_for_me(NodeId(1)));
+
+    nodes.get_node(NodeId(1))->set_match_idx(3);
+    nodes.get_node(NodeId(2))->set_match_idx(3);
+    nodes.get_node(NodeId(7))->set_match_idx(4);
+    EXPECT_FALSE(nodes.is_committed(3));
+    nodes.get_node(NodeId(6))->set_match_idx(3);
+    EXPECT_TRUE(nodes.is_committed(3));
+    EXPECT_FALSE(nodes.is_committed(4));
+    EXPECT_EQ(3, nodes.get_quorum_idx());
+
+    nodes.reset_all_votes();
+    EXPECT_EQ(0, nodes.get_nvotes_for_me(bmcl::None));
+    Nodes copy = nodes;
+    EXPECT_TRUE(copy.is_committed(3));
+    EXPECT_EQ(6, copy.get_num_voting_nodes());
+}
+
+TEST(TestNode, voter_beyond_slot_capacity_stays_non_voting)
+{
+    Nodes nodes(NodeId(1));
+    nodes.add_my_node(true);
+    for (std::size_t i = 2; i <= 65; ++i)
+        nodes.add_node(NodeId(i), true);
+    EXPECT_EQ(65, nodes.count());
+    EXPECT_EQ(ReplicationState::Capacity, nodes.get_num_voting_nodes());
+    EXPECT_FALSE(nodes.has_free_voting_slot());
+    EXPECT_FALSE(nodes.get_node(NodeId(65))->is_voting());
+    EXPECT_FALSE(nodes.get_node(NodeId(65))->set_voting(true));
+    EXPECT_FALSE(nodes.get_node(NodeId(65))->is_voting());
+
+    for (std::size_t i = 1; i <= 65; ++i)
+        nodes.get_node(NodeId(i))->set_match_idx(i <= 33 ? 2 : 1);
+    EXPECT_TRUE(nodes.is_committed(2));
+    nodes.get_node(NodeId(33))->set_match_idx(1);
+    EXPECT_FALSE(nodes.is_committed(2));
+
+    /* a freed slot can be taken by the node left out */
+    nodes.remove_node(NodeId(2));
+    EXPECT_TRUE(nodes.get_node(NodeId(65))->set_voting(true));
+    EXPECT_EQ(ReplicationState::Capacity, nodes.get_num_voting_nodes());
+    Nodes copy = nodes;
+    EXPECT_EQ(ReplicationState::Capacity, copy.get_num_voting_nodes());
+}
+
+TEST(TestNode, copied_node_doesnt_change_replication_state_of_nodes)
+{
+    Nodes nodes(NodeId(1));
+    nodes.add_my_node(true);
+    nodes.add_node(NodeId(2), true);
+    nodes.add_node(NodeId(3), true);
+    nodes.get_node(NodeId(1))->set_match_idx(2);
+    nodes.get_node(NodeId(2))->set_match_idx(2);
+    EXPECT_TRUE(nodes.is_committed(2));
+
+    Node n = *nodes.get_node(NodeId(2));
+    n.set_match_idx(5);
+    n.vote_for_me(true);
+    n.set_voting(false);
+    EXPECT_FALSE(n.is_voting());
+    EXPECT_EQ(3, nodes.get_num_voting_nodes());
+    EXPECT_EQ(2, nodes.get_quorum_idx());
+    EXPECT_EQ(0, nodes.get_nvotes_for_me(bmcl::None));
+    EXPECT_TRUE(nodes.get_node(NodeId(2))->is_voting());
+
+    n = *nodes.get_node(NodeId(3));
+    n.set_match_idx(7);
+    EXPECT_EQ(2, nodes.get_quorum_idx());
+    EXPECT_EQ(0, nodes.get_node(NodeId(3))->get_match_idx());
+}
@@ -1,6 +1,14 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include "raft/Raft.h"
 #include "raft/Committer.h"
+#include "raft/FileStorage.h"
 #include "mock_send_functions.h"
 
 using namespace raft;
@@ -69,6 +77,7 @@ class DefualtSender : public ISender
 public:
     bmcl::Option<Error> request_vote(const NodeId& node, const MsgVoteReq& msg) override { return bmcl::None; }
     bmcl::Option<Error> append_entries(const NodeId& node, const MsgAppendEntriesReq& msg) override { return bmcl::None; }
+    bmcl::Option<Error> install_snapshot(const NodeId& node, const MsgInstallSnapshotReq& msg) override { return bmcl::None; }
 };
 
 DefualtSender __Sender;
@@ -196,6 +205,55 @@ TEST(TestServer, increment_lastApplied_when_lastApplied_lt_commitidx)
     EXPECT_EQ(1, r.committer().get_last_applied_idx());
 }
 
+TEST(TestServer, apply_thread_applies_committed_entries_in_order)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), true, __Applier, &storage, &__Sender);
+    r.tick(r.timer().get_max_election_timeout());
+    ASSERT_TRUE(r.is_leader());
+    r.tick();
+
+    std::mutex mutex;
+    std::vector<Index> applied;
+    std::thread::id server_thread = std::this_thread::get_id();
+    bool other_thread = true;
+    r.set_applier([&](Index idx, const Entry&)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        applied.push_back(idx);
+        other_thread = other_thread && std::this_thread::get_id() != server_thread;
+        return bmcl::None;
+    });
+    r.set_apply_thread(2);
+    EXPECT_TRUE(r.has_apply_thread());
+    Index first = r.committer().get_last_applied_idx() + 1;
+
+    for (EntryId i = 1; i <= 5; ++i)
+        r.add_entry(i, raft::UserData("aaa", 4));
+    while (r.committer().has_not_applied())
+        EXPECT_TRUE(r.tick().isNone());
+    EXPECT_TRUE(r.wait_applied().isNone());
+    EXPECT_EQ(r.committer().get_commit_idx(), r.get_applied_idx());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ASSERT_EQ(5, applied.size());
+        for (std::size_t i = 0; i < applied.size(); ++i)
+            EXPECT_EQ(first + i, applied[i]);
+        EXPECT_TRUE(other_thread);
+    }
+
+    /* the thread is restarted with the new applier, its error stops the thread and is reported by tick */
+    r.set_applier([](Index, const Entry&) { return bmcl::Option<Error>(Error::CantStore); });
+    EXPECT_TRUE(r.has_apply_thread());
+    r.add_entry(6, raft::UserData("aaa", 4));
+    r.tick();
+    EXPECT_EQ(Error::CantStore, r.wait_applied().unwrapOr(Error::Shutdown));
+    EXPECT_EQ(Error::CantStore, r.tick().unwrapOr(Error::Shutdown));
+    EXPECT_EQ(first + 4, r.get_applied_idx());
+    r.set_apply_thread(0);
+    EXPECT_FALSE(r.has_apply_thread());
+}
+
 TEST(TestServer, periodic_elapses_election_timeout)
 {
     MemStorage storage;
@@ -622,6 +680,28 @@ TEST(TestFollower, recv_appendentries_reply_false_if_doesnt_have_log_at_prev_log
     EXPECT_FALSE(aer.unwrap().success);
 }
 
+TEST(TestFollower, recv_appendentries_reply_false_with_conflict_term_if_prev_log_term_differs)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_follower(r);
+    Index count = storage.get_current_idx();
+    storage.push_back(Entry(2, 1, raft::UserData("aaa", 4)));
+    storage.push_back(Entry(3, 2, raft::UserData("aaa", 4)));
+    storage.push_back(Entry(3, 3, raft::UserData("aaa", 4)));
+    storage.push_back(Entry(3, 4, raft::UserData("aaa", 4)));
+
+    Entry ety(4, 5, raft::UserData("aaa", 4));
+    MsgAppendEntriesReq ae(r.get_current_term(), 4, 0, 0, DataHandler(&ety, count + 4, 1));
+
+    auto aer = r.accept_req(raft::NodeId(2), ae);
+    ASSERT_TRUE(aer.isOk());
+    EXPECT_FALSE(aer.unwrap().success);
+    EXPECT_EQ(3, aer.unwrap().conflict_term);
+    EXPECT_EQ(count + 2, aer.unwrap().conflict_idx);
+    EXPECT_EQ(count + 4, storage.get_current_idx());
+}
+
 static void __create_mock_entries_for_conflict_tests(IStorage* lc, std::vector<uint8_t>* strs)
 {
     std::size_t count = lc->count();
@@ -743,6 +823,116 @@ TEST(TestFollower, recv_appendentries_delete_entries_if_current_idx_greater_than
 
 // TODO: add TestRaft_follower_recv_appendentries_delete_entries_if_term_is_different
 
+TEST(TestFollower, recv_appendentries_truncates_conflicting_tail_at_once)
+{
+    struct Events : public IEventHandler
+    {
+        void entry_poped(Index entry_idx, const Entry& ety) override { poped.emplace_back(entry_idx, ety.id()); }
+        void entries_truncated(Index first_idx, Index last_idx) override { truncated.emplace_back(first_idx, last_idx); }
+        std::vector<std::pair<Index, EntryId>> poped;
+        std::vector<std::pair<Index, Index>> truncated;
+    } events;
+
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender, &events);
+    prepare_follower(r);
+    Index count = storage.get_current_idx();
+
+    Entry old[4] = { Entry::user_empty(1, 1), Entry::add_nonvoting_node(1, 2, NodeId(3)), Entry::user_empty(1, 3), Entry::user_empty(1, 4) };
+    ASSERT_TRUE(r.accept_req(raft::NodeId(2), MsgAppendEntriesReq(r.get_current_term(), 0, 0, 0, DataHandler(old, count, 4))).isOk());
+    ASSERT_TRUE(r.nodes().get_node(NodeId(3)).isSome());
+    std::size_t cfg_changes = r.committer().get_cfg_change_idxs().size();
+    ASSERT_LT(0, cfg_changes);
+    EXPECT_EQ(count + 2, r.committer().get_cfg_change_idxs().back());
+
+    Entry ety(2, 5, raft::UserData("aaa", 4));
+    auto aer = r.accept_req(raft::NodeId(2), MsgAppendEntriesReq(r.get_current_term(), 1, 0, 0, DataHandler(&ety, count + 1, 1)));
+    ASSERT_TRUE(aer.isOk());
+    EXPECT_TRUE(aer.unwrap().success);
+    EXPECT_EQ(count + 2, storage.get_current_idx());
+    EXPECT_EQ(5, storage.back()->id());
+
+    /* the whole tail is reported once and the configuration change in it is reverted */
+    ASSERT_EQ(1, events.truncated.size());
+    EXPECT_EQ(count + 2, events.truncated[0].first);
+    EXPECT_EQ(count + 4, events.truncated[0].second);
+    EXPECT_FALSE(r.nodes().get_node(NodeId(3)).isSome());
+    EXPECT_FALSE(r.committer().voting_change_is_in_progress());
+    EXPECT_EQ(cfg_changes - 1, r.committer().get_cfg_change_idxs().size());
+    EXPECT_TRUE(events.poped.empty());
+
+    /* handlers which opted in still see every dropped entry, from the tail */
+    r.set_entry_poped_events(true);
+    ASSERT_TRUE(r.accept_req(raft::NodeId(2), MsgAppendEntriesReq(r.get_current_term(), 0, 0, 0, DataHandler(old, count, 4))).isOk());
+    ASSERT_EQ(2, events.truncated.size());
+    ASSERT_EQ(1, events.poped.size());
+    EXPECT_EQ(count + 1, events.poped[0].first);
+    EXPECT_EQ(5, events.poped[0].second);
+    EXPECT_EQ(count + 2, r.committer().get_cfg_change_idxs().back());
+}
+
+TEST(TestFollower, recv_appendentries_drops_batch_with_damaged_entry)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_follower(r);
+    Index count = storage.get_current_idx();
+
+    Entry ety[2] = { Entry(1, 1, raft::UserData("aaa", 4)), Entry(1, 2, raft::UserData("bbb", 4)) };
+    ety[0].seal();
+    ety[1].set_checksum(ety[1].compute_checksum() ^ 1);
+    auto aer = r.accept_req(raft::NodeId(2), MsgAppendEntriesReq(r.get_current_term(), 0, 0, 0, DataHandler(ety, count, 2)));
+    ASSERT_TRUE(aer.isErr());
+    EXPECT_EQ(Error::Corrupted, aer.unwrapErr());
+    EXPECT_EQ(count, storage.get_current_idx());
+
+    ety[1].seal();
+    aer = r.accept_req(raft::NodeId(2), MsgAppendEntriesReq(r.get_current_term(), 0, 0, 0, DataHandler(ety, count, 2)));
+    ASSERT_TRUE(aer.isOk());
+    EXPECT_EQ(count + 2, storage.get_current_idx());
+}
+
+TEST(TestFollower, restarts_with_configuration_recovered_by_storage)
+{
+    class RecoveredStorage : public MemStorage
+    {
+    public:
+        bmcl::Option<RecoveredState> get_recovered() const override
+        {
+            RecoveredState state;
+            state.term = term();
+            state.vote = vote();
+            state.last_idx = get_current_idx();
+            return state;
+        }
+    };
+
+    struct Events : public IEventHandler
+    {
+        Events() : last_idx(0) {}
+        void recovered(TermId, bmcl::Option<NodeId>, Index idx) override { last_idx = idx; }
+        Index last_idx;
+    } events;
+
+    RecoveredStorage storage;
+    storage.persist_term_vote(2, NodeId(3));
+    storage.push_back(Entry::add_node(0, 0, NodeId(1)));
+    storage.push_back(Entry::add_node(0, 0, NodeId(2)));
+    storage.push_back(Entry::add_node(0, 0, NodeId(3)));
+    storage.push_back(Entry::add_nonvoting_node(1, 1, NodeId(4)));
+    storage.push_back(Entry::user_empty(2, 2));
+
+    raft::Server r(raft::NodeId(1), false, __Applier, &storage, &__Sender, &events);
+    EXPECT_TRUE(r.is_follower());
+    EXPECT_EQ(2, r.get_current_term());
+    EXPECT_EQ(NodeId(3), r.get_voted_for().unwrap());
+    EXPECT_EQ(5, events.last_idx);
+    EXPECT_EQ(5, r.committer().get_current_idx());
+    EXPECT_EQ(4, r.nodes().count());
+    EXPECT_EQ(3, r.nodes().get_num_voting_nodes());
+    EXPECT_TRUE(r.nodes().get_my_node().isSome());
+}
+
 TEST(TestFollower, recv_appendentries_add_new_entries_not_already_in_log)
 {
     MemStorage storage;
@@ -758,6 +948,69 @@ TEST(TestFollower, recv_appendentries_add_new_entries_not_already_in_log)
     EXPECT_EQ(2, storage.count());
 }
 
+TEST(TestFollower, recv_appendentries_applies_cfg_changes_inside_batch)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_follower(r);
+    Index count = storage.get_current_idx();
+
+    Entry ety[3] = { Entry::user_empty(1, 1), Entry::add_nonvoting_node(1, 2, NodeId(3)), Entry::user_empty(1, 3) };
+    MsgAppendEntriesReq ae(r.get_current_term(), 0, 0, 0, DataHandler(ety, count, 3));
+
+    auto aer = r.accept_req(raft::NodeId(2), ae);
+    ASSERT_TRUE(aer.isOk());
+    EXPECT_TRUE(aer.unwrap().success);
+    EXPECT_EQ(count + 3, aer.unwrap().current_idx);
+    EXPECT_EQ(count + 3, storage.get_current_idx());
+    ASSERT_TRUE(r.nodes().get_node(NodeId(3)).isSome());
+    EXPECT_FALSE(r.nodes().get_node(NodeId(3))->is_voting());
+    EXPECT_TRUE(r.committer().voting_change_is_in_progress());
+}
+
+TEST(TestFollower, recv_installsnapshot_resumes_from_received_offset_and_installs)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_follower(r);
+
+    raft::Buffer installed;
+    r.set_snapshot_applier([&installed](const Snapshot& s) { installed = s.data.data; return bmcl::None; });
+
+    const uint8_t data[] = { 1, 2, 3, 4, 5, 6 };
+    SnapshotMember members[] = { SnapshotMember(NodeId(1), true), SnapshotMember(NodeId(2), true), SnapshotMember(NodeId(3), false) };
+    TermId term = r.get_current_term();
+
+    auto rep = r.accept_req(NodeId(2), MsgInstallSnapshotReq(term, 10, term, 0, false, bmcl::ArrayView<uint8_t>(data, 4), members));
+    ASSERT_TRUE(rep.isOk());
+    EXPECT_EQ(4, rep.unwrap().offset);
+    EXPECT_FALSE(rep.unwrap().done);
+
+    /* chunk from the wrong offset tells the leader where to continue */
+    rep = r.accept_req(NodeId(2), MsgInstallSnapshotReq(term, 10, term, 2, false, bmcl::ArrayView<uint8_t>(data + 2, 2), members));
+    ASSERT_TRUE(rep.isOk());
+    EXPECT_EQ(4, rep.unwrap().offset);
+    EXPECT_TRUE(installed.empty());
+
+    rep = r.accept_req(NodeId(2), MsgInstallSnapshotReq(term, 10, term, 4, true, bmcl::ArrayView<uint8_t>(data + 4, 2), members));
+    ASSERT_TRUE(rep.isOk());
+    EXPECT_TRUE(rep.unwrap().done);
+    EXPECT_EQ(std::vector<uint8_t>(data, data + 6), installed);
+    EXPECT_EQ(10, storage.get_base_idx());
+    EXPECT_EQ(10, r.committer().get_current_idx());
+    EXPECT_EQ(10, r.committer().get_commit_idx());
+    EXPECT_EQ(10, r.committer().get_last_applied_idx());
+    EXPECT_EQ(3, r.nodes().count());
+    EXPECT_FALSE(r.nodes().get_node(NodeId(3))->is_voting());
+
+    /* log continues right after the snapshot */
+    Entry ety = Entry::user_empty(term, 11);
+    auto aer = r.accept_req(NodeId(2), MsgAppendEntriesReq(term, term, 11, 0, DataHandler(&ety, 10, 1)));
+    ASSERT_TRUE(aer.isOk());
+    EXPECT_TRUE(aer.unwrap().success);
+    EXPECT_EQ(11, r.committer().get_current_idx());
+}
+
 TEST(TestFollower, recv_appendentries_does_not_add_dupe_entries_already_in_log)
 {
     MemStorage storage;
@@ -1551,6 +1804,397 @@ TEST(TestLeader, sends_appendentries_with_prevLogIdx)
     }
 }
 
+TEST(TestLeader, sends_appendentries_with_prev_log_term_from_snapshot)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    r.add_entry(1, raft::UserData("aaa", 4));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, storage.get_current_idx()));
+    r.tick();
+    Index last = r.committer().get_last_applied_idx();
+    EXPECT_EQ(storage.get_current_idx(), last);
+
+    EXPECT_TRUE(r.compact(raft::UserData("state", 6)).isNone());
+    EXPECT_EQ(last, storage.get_base_idx());
+    EXPECT_EQ(0, storage.count());
+    ASSERT_TRUE(storage.get_snapshot().isSome());
+    EXPECT_EQ(2, storage.get_snapshot()->members.size());
+
+    Exchanger sender(&r);
+    sender.clear();
+    r.add_entry(2, raft::UserData("bbb", 4));
+    r.send_appendentries(raft::NodeId(2));
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(last, ae->data.prev_log_idx());
+    EXPECT_EQ(r.get_current_term(), ae->prev_log_term);
+    EXPECT_EQ(2, ae->data.get_at_idx(last + 1)->id());
+}
+
+TEST(TestLeader, sends_appendentries_limited_by_count_and_bytes)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    for (EntryId i = 1; i <= 5; ++i)
+        r.add_entry(i, raft::UserData("aaaa", 4));
+    r.set_max_entries_per_append(3);
+    r.set_max_bytes_per_append(10);
+
+    Exchanger sender(&r);
+    sender.clear();
+    r.send_appendentries(raft::NodeId(2));
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first - 1, ae->data.prev_log_idx());
+    EXPECT_EQ(2, ae->data.count());
+
+    /* the rest is sent once the batch is acknowledged */
+    r.set_max_bytes_per_append(std::size_t(-1));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first + 1));
+    msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first + 1, ae->data.prev_log_idx());
+    EXPECT_EQ(3, ae->data.count());
+}
+
+TEST(TestLeader, batches_appendentries_of_proposals_until_threshold)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    r.set_proposal_batch(3, std::size_t(-1), Time(50));
+
+    Exchanger sender(&r);
+    sender.clear();
+    r.add_entry(1, raft::UserData("aaaa", 4));
+    r.add_entry(2, raft::UserData("aaaa", 4));
+    EXPECT_EQ(first + 1, storage.get_current_idx());
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+
+    /* count threshold sends the whole batch in one message */
+    r.add_entry(3, raft::UserData("aaaa", 4));
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first - 1, ae->data.prev_log_idx());
+    EXPECT_EQ(3, ae->data.count());
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first + 2));
+
+    /* the rest waits for a tick past the delay */
+    r.add_entry(4, raft::UserData("aaaa", 4));
+    r.tick(Time(10));
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+    r.tick(Time(40));
+    msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first + 2, ae->data.prev_log_idx());
+    EXPECT_EQ(1, ae->data.count());
+}
+
+TEST(TestLeader, heartbeat_sends_held_proposals_only_once)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    r.set_proposal_batch(3, std::size_t(-1), Time(1000000));
+
+    Exchanger sender(&r);
+    sender.clear();
+    r.add_entry(1, raft::UserData("aaaa", 4));
+    r.add_entry(2, raft::UserData("aaaa", 4));
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+
+    /* the heartbeat carries the held proposals */
+    r.tick(r.timer().get_request_timeout());
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first - 1, ae->data.prev_log_idx());
+    EXPECT_EQ(2, ae->data.count());
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+
+    /* the window is empty, neither a flush nor the next proposals send them again */
+    r.flush_proposals();
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+    r.add_entry(3, raft::UserData("aaaa", 4));
+    r.add_entry(4, raft::UserData("aaaa", 4));
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+}
+
+TEST(TestLeader, add_entries_appends_batch_and_sends_it_in_one_appendentries)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+
+    Exchanger sender(&r);
+    sender.clear();
+    std::vector<Proposal> batch = { Proposal(1, raft::UserData("aaa", 4)), Proposal(2, raft::UserData("bbb", 4)), Proposal(3, raft::UserData("ccc", 4)) };
+    auto rep = r.add_entries(batch);
+    ASSERT_TRUE(rep.isOk());
+    EXPECT_EQ(first, rep.unwrap().first_idx);
+    EXPECT_EQ(first + 2, rep.unwrap().last_idx);
+    EXPECT_EQ(r.get_current_term(), rep.unwrap().term);
+    EXPECT_EQ(first + 2, storage.get_current_idx());
+    EXPECT_EQ(EntryId(2), storage.get_at_idx(first + 1)->id());
+
+    for (int i = 0; i < 2; ++i)
+    {
+        bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+        ASSERT_TRUE(msg.isSome());
+        MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+        ASSERT_NE(nullptr, ae);
+        EXPECT_EQ(first - 1, ae->data.prev_log_idx());
+        EXPECT_EQ(3, ae->data.count());
+    }
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+
+    rep = r.add_entries(bmcl::ArrayView<Proposal>());
+    ASSERT_TRUE(rep.isOk());
+    EXPECT_EQ(first + 3, rep.unwrap().first_idx);
+    EXPECT_EQ(first + 2, rep.unwrap().last_idx);
+}
+
+TEST(TestLeader, pipelines_appendentries_up_to_inflight_window)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    for (EntryId i = 1; i <= 5; ++i)
+        r.add_entry(i, raft::UserData("aaaa", 4));
+    r.set_max_entries_per_append(1);
+    r.set_max_inflight_appends(3);
+
+    Exchanger sender(&r);
+    sender.clear();
+    r.send_appendentries(raft::NodeId(2));
+    for (Index i = 0; i < 3; ++i)
+    {
+        bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+        ASSERT_TRUE(msg.isSome());
+        MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+        ASSERT_NE(nullptr, ae);
+        EXPECT_EQ(first - 1 + i, ae->data.prev_log_idx());
+        EXPECT_EQ(1, ae->data.count());
+    }
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+    bmcl::Option<const raft::Node&> n = r.nodes().get_node(raft::NodeId(2));
+    EXPECT_EQ(first + 3, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    /* acknowledged batch frees a slot in the window */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first));
+    EXPECT_EQ(first, n->get_match_idx());
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first + 2, ae->data.prev_log_idx());
+}
+
+TEST(TestLeader, inflight_window_ignores_duplicate_and_stale_acks)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    for (EntryId i = 1; i <= 5; ++i)
+        r.add_entry(i, raft::UserData("aaaa", 4));
+    r.set_max_entries_per_append(1);
+    r.set_max_inflight_appends(3);
+
+    r.send_appendentries(raft::NodeId(2));
+    bmcl::Option<const raft::Node&> n = r.nodes().get_node(raft::NodeId(2));
+    EXPECT_EQ(first + 3, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first));
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    /* neither a duplicate nor an older ack frees the window */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first - 1));
+    EXPECT_EQ(first, n->get_match_idx());
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    /* ack which covers two batches frees both of them, the last entry takes one slot */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first + 2));
+    EXPECT_EQ(first + 2, n->get_match_idx());
+    EXPECT_EQ(first + 5, n->get_next_idx());
+    EXPECT_EQ(2, n->get_inflight_count());
+
+    /* ack of a batch which is not in flight anymore frees nothing else */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first + 1));
+    EXPECT_EQ(2, n->get_inflight_count());
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first + 4));
+    EXPECT_EQ(0, n->get_inflight_count());
+}
+
+TEST(TestLeader, inflight_window_heartbeat_follows_match_idx)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    for (EntryId i = 1; i <= 5; ++i)
+        r.add_entry(i, raft::UserData("aaaa", 4));
+    r.set_max_entries_per_append(1);
+    r.set_max_inflight_appends(3);
+
+    Exchanger sender(&r);
+    r.send_appendentries(raft::NodeId(2));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first));
+    bmcl::Option<const raft::Node&> n = r.nodes().get_node(raft::NodeId(2));
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    /* the batches in flight are reordered, the heartbeat doesn't depend on them */
+    sender.clear();
+    r.send_appendentries(raft::NodeId(2));
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first, ae->data.prev_log_idx());
+    EXPECT_EQ(0, ae->data.count());
+    EXPECT_EQ(storage.get_at_idx(first)->term(), ae->prev_log_term);
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+
+    /* the node has what the heartbeat follows, its answer rolls nothing back */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first));
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first + 2));
+    EXPECT_EQ(first + 2, n->get_match_idx());
+    EXPECT_EQ(first + 5, n->get_next_idx());
+}
+
+TEST(TestLeader, inflight_window_rollback_ignores_rejections_of_later_batches)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index first = storage.get_current_idx() + 1;
+    for (EntryId i = 1; i <= 5; ++i)
+        r.add_entry(i, raft::UserData("aaaa", 4));
+    r.set_max_entries_per_append(1);
+    r.set_max_inflight_appends(3);
+
+    r.send_appendentries(raft::NodeId(2));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, first));
+    bmcl::Option<const raft::Node&> n = r.nodes().get_node(raft::NodeId(2));
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    /* rejection rolls next_idx back to what the node has, nothing is resent without a sender */
+    r.set_sender(nullptr);
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), false, first));
+    EXPECT_EQ(first + 1, n->get_next_idx());
+    EXPECT_EQ(0, n->get_inflight_count());
+    EXPECT_TRUE(n->need_append_endtries_req());
+
+    /* the two batches which followed the rejected one are rejected as well */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), false, first));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), false, first));
+    EXPECT_EQ(first + 1, n->get_next_idx());
+
+    Exchanger sender(&r);
+    sender.clear();
+    r.send_appendentries(raft::NodeId(2));
+    bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+    ASSERT_TRUE(msg.isSome());
+    MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+    ASSERT_NE(nullptr, ae);
+    EXPECT_EQ(first, ae->data.prev_log_idx());
+    EXPECT_EQ(3, n->get_inflight_count());
+
+    /* rejection of the resent batch is not stale */
+    EXPECT_EQ(first + 4, n->get_next_idx());
+    r.set_sender(nullptr);
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), false, first));
+    EXPECT_EQ(first + 1, n->get_next_idx());
+    EXPECT_EQ(0, n->get_inflight_count());
+}
+
+TEST(TestLeader, sends_snapshot_in_chunks_to_node_behind_base)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, storage.get_current_idx()));
+    r.tick();
+    Index last = r.committer().get_last_applied_idx();
+    EXPECT_TRUE(r.compact(raft::UserData("state", 6)).isNone());
+    r.add_entry(1, raft::UserData("aaa", 4));
+    r.set_snapshot_chunk_size(4);
+
+    Exchanger sender(&r);
+    sender.clear();
+
+    /* node 3 has no log, so it needs the snapshot */
+    r.accept_rep(raft::NodeId(3), MsgAppendEntriesRep(r.get_current_term(), false, 0));
+    {
+        bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+        ASSERT_TRUE(msg.isSome());
+        MsgInstallSnapshotReq* req = msg->cast_to_installsnapshot().unwrapOr(nullptr);
+        ASSERT_NE(nullptr, req);
+        EXPECT_EQ(last, req->last_idx);
+        EXPECT_EQ(0, req->offset);
+        EXPECT_EQ(4, req->chunk.size());
+        EXPECT_FALSE(req->done);
+        EXPECT_EQ(3, req->members.size());
+    }
+
+    /* nothing else is sent until the chunk is acknowledged */
+    EXPECT_FALSE(sender.poll_msg_data(r).isSome());
+
+    r.accept_rep(raft::NodeId(3), MsgInstallSnapshotRep(r.get_current_term(), last, 4, false));
+    {
+        bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+        ASSERT_TRUE(msg.isSome());
+        MsgInstallSnapshotReq* req = msg->cast_to_installsnapshot().unwrapOr(nullptr);
+        ASSERT_NE(nullptr, req);
+        EXPECT_EQ(4, req->offset);
+        EXPECT_EQ(2, req->chunk.size());
+        EXPECT_TRUE(req->done);
+    }
+
+    r.accept_rep(raft::NodeId(3), MsgInstallSnapshotRep(r.get_current_term(), last, 6, true));
+    bmcl::Option<const raft::Node&> n = r.nodes().get_node(raft::NodeId(3));
+    EXPECT_EQ(last, n->get_match_idx());
+    {
+        /* remaining entries follow right away */
+        bmcl::Option<msg_t> msg = sender.poll_msg_data(r);
+        ASSERT_TRUE(msg.isSome());
+        MsgAppendEntriesReq* ae = msg->cast_to_appendentries().unwrapOr(nullptr);
+        ASSERT_NE(nullptr, ae);
+        EXPECT_EQ(last, ae->data.prev_log_idx());
+        EXPECT_EQ(1, ae->data.count());
+    }
+}
+
 TEST(TestLeader, sends_appendentries_when_node_has_next_idx_of_0)
 {
     MemStorage storage;
@@ -1983,6 +2627,28 @@ TEST(TestLeader, recv_entry_is_committed_returns_0_if_not_committed)
     EXPECT_EQ(EntryState::Committed, r.committer().entry_get_state(cr.unwrap()));
 }
 
+TEST(TestLeader, recv_entry_moves_payload_into_log_without_copies)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+
+    int deleted = 0;
+    uint8_t* buf = new uint8_t[4]{ 1, 2, 3, 4 };
+    raft::UserData data(buf, 4, [&deleted](const uint8_t* p) { ++deleted; delete[] p; });
+    auto cr = r.add_entry(1, std::move(data));
+    ASSERT_TRUE(cr.isOk());
+
+    bmcl::Option<const Entry&> ety = r.committer().get_at_idx(cr.unwrap().idx);
+    ASSERT_TRUE(ety.isSome());
+    EXPECT_EQ(buf, ety->getUserData()->data.data());
+    /* the log holds the only reference, nothing on the way kept a copy */
+    EXPECT_EQ(1, ety->getUserData()->data.use_count());
+
+    storage.pop_back();
+    EXPECT_EQ(1, deleted);
+}
+
 TEST(TestLeader, recv_entry_is_committed_returns_neg_1_if_invalidated)
 {
     MemStorage storage;
@@ -2059,6 +2725,154 @@ TEST(TestLeader, recv_appendentries_response_failure_does_not_set_node_nextid_to
     EXPECT_EQ(1, p->get_next_idx());
 }
 
+TEST(TestLeader, recv_appendentries_response_failure_skips_conflicting_term)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    r.accept_req(raft::NodeId(2), MsgAppendEntriesReq(3));
+    Index count = storage.get_current_idx();
+    storage.push_back(Entry(1, 1, raft::UserData("aaa", 4)));
+    storage.push_back(Entry(1, 2, raft::UserData("aaa", 4)));
+    storage.push_back(Entry(2, 3, raft::UserData("aaa", 4)));
+    storage.push_back(Entry(2, 4, raft::UserData("aaa", 4)));
+    prepare_leader(r);
+
+    bmcl::Option<const Node&> p = r.nodes().get_node(raft::NodeId(2));
+    ASSERT_TRUE(p.isSome());
+    EXPECT_EQ(count + 6, p->get_next_idx());
+
+    /* node has entries of term 3 from count + 3 on, we have none of them */
+    r.accept_rep(p->get_id(), MsgAppendEntriesRep(r.get_current_term(), false, count + 5, 3, count + 3));
+    EXPECT_EQ(count + 3, p->get_next_idx());
+
+    /* node has entries of term 1, continue right after our last one */
+    r.accept_rep(p->get_id(), MsgAppendEntriesRep(r.get_current_term(), false, count + 4, 1, count + 1));
+    EXPECT_EQ(count + 2, p->get_next_idx());
+}
+
+TEST(TestLeader, recv_appendentries_response_commits_idx_matched_by_majority_when_acks_are_out_of_order)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3), NodeId(4), NodeId(5) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    Index ci = r.committer().get_current_idx();
+    r.add_entry(1, raft::UserData("aaa", 4));
+    r.add_entry(2, raft::UserData("aaa", 4));
+
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, ci + 1));
+    EXPECT_EQ(0, r.committer().get_commit_idx());
+
+    /* ci + 2 is not on a majority, but ci + 1 now is */
+    r.accept_rep(raft::NodeId(3), MsgAppendEntriesRep(r.get_current_term(), true, ci + 2));
+    EXPECT_EQ(ci + 1, r.committer().get_commit_idx());
+
+    r.accept_rep(raft::NodeId(4), MsgAppendEntriesRep(r.get_current_term(), true, ci + 2));
+    EXPECT_EQ(ci + 2, r.committer().get_commit_idx());
+}
+
+TEST(TestLeader, counts_only_durable_entries_of_its_own_log_for_commit)
+{
+    /* storage which reports durability only when the test says so */
+    class AsyncStorage : public MemStorage
+    {
+    public:
+        AsyncStorage() : durable(0), flushes(0) {}
+        bmcl::Option<Error> flush() override { ++flushes; return bmcl::None; }
+        Index get_durable_idx() const override { return std::min(durable, get_current_idx()); }
+        Index durable;
+        std::size_t flushes;
+    };
+
+    AsyncStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2), NodeId(3) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    storage.durable = storage.get_current_idx();
+    r.durable_idx_advanced();
+    Index ci = r.committer().get_current_idx();
+    r.add_entry(1, raft::UserData("aaa", 4));
+    EXPECT_LT(0, storage.flushes);
+    EXPECT_EQ(ci, r.nodes().get_my_node()->get_match_idx());
+
+    /* the entry was sent before it became durable here, one ack is not a majority yet */
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, ci + 1));
+    EXPECT_GT(ci + 1, r.committer().get_commit_idx());
+
+    storage.durable = ci + 1;
+    r.durable_idx_advanced();
+    EXPECT_EQ(ci + 1, r.nodes().get_my_node()->get_match_idx());
+    EXPECT_EQ(ci + 1, r.committer().get_commit_idx());
+
+    /* followers alone are a majority too */
+    r.add_entry(2, raft::UserData("aaa", 4));
+    r.accept_rep(raft::NodeId(2), MsgAppendEntriesRep(r.get_current_term(), true, ci + 2));
+    EXPECT_EQ(ci + 1, r.committer().get_commit_idx());
+    r.accept_rep(raft::NodeId(3), MsgAppendEntriesRep(r.get_current_term(), true, ci + 2));
+    EXPECT_EQ(ci + 2, r.committer().get_commit_idx());
+}
+
+TEST(TestLeader, commits_when_storage_reports_flush_without_tick)
+{
+    char tmpl[] = "/tmp/raftcpp-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(tmpl));
+    std::string dir = tmpl;
+    {
+        /* the completion is posted to the thread of the server, here it is the test thread */
+        std::mutex mutex;
+        std::condition_variable posted;
+        std::deque<Index> flushed;
+        auto wait_posted = [&]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            EXPECT_TRUE(posted.wait_for(lock, std::chrono::seconds(10), [&]() { return !flushed.empty(); }));
+            Index idx = flushed.empty() ? Index(-1) : flushed.back();
+            flushed.clear();
+            return idx;
+        };
+
+        FileStorage storage(dir);
+        ASSERT_TRUE(storage.open().isNone());
+        storage.set_durable_handler([&](Index idx)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            flushed.push_back(idx);
+            posted.notify_all();
+        });
+
+        raft::Server r(raft::NodeId(1), { NodeId(1) }, __Applier, &storage, &__Sender);
+        r.tick();
+        ASSERT_TRUE(r.is_leader());
+        Index ci = r.committer().get_current_idx();
+        for (Index idx = storage.get_durable_idx(); idx < ci; idx = wait_posted()) {}
+        r.durable_idx_advanced();
+        ASSERT_EQ(ci, r.committer().get_commit_idx());
+
+        ASSERT_TRUE(r.add_entry(1, raft::UserData("aaa", 4)).isOk());
+        for (Index idx = storage.get_durable_idx(); idx < ci + 1; idx = wait_posted()) {}
+        r.durable_idx_advanced();
+        EXPECT_EQ(ci + 1, r.committer().get_commit_idx());
+    }
+
+    DIR* d = opendir(dir.c_str());
+    while (const dirent* i = readdir(d))
+        unlink((dir + "/" + i->d_name).c_str());
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+TEST(TestLeader, seals_new_entries_when_checksums_are_enabled)
+{
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), { NodeId(1), NodeId(2) }, __Applier, &storage, &__Sender);
+    prepare_leader(r);
+    r.add_entry(1, raft::UserData("aaa", 4));
+    EXPECT_TRUE(storage.back()->checksum().isNone());
+
+    r.set_entry_checksums(true);
+    r.add_entry(2, raft::UserData("aaa", 4));
+    ASSERT_TRUE(storage.back()->checksum().isSome());
+    EXPECT_TRUE(storage.back()->is_intact());
+}
+
 TEST(TestLeader, recv_appendentries_response_increment_idx_of_node)
 {
     MemStorage storage;
@@ -2297,3 +3111,26 @@ TEST(TestLeader, remove_me)
     r.tick();
     EXPECT_TRUE(r.is_shutdown());
 }
+
+TEST(TestLeader, voting_nodes_beyond_slot_capacity_are_not_promoted)
+{
+    std::vector<NodeId> members;
+    for (std::size_t i = 1; i <= 65; ++i)
+        members.push_back(NodeId(i));
+    MemStorage storage;
+    raft::Server r(raft::NodeId(1), bmcl::ArrayView<NodeId>(members), __Applier, &storage, &__Sender);
+    EXPECT_EQ(65, r.nodes().count());
+    EXPECT_EQ(ReplicationState::Capacity, r.nodes().get_num_voting_nodes());
+    EXPECT_FALSE(r.nodes().get_node(NodeId(65))->is_voting());
+
+    prepare_leader(r);
+    auto e = r.add_node(1, NodeId(66));
+    ASSERT_TRUE(e.isErr());
+    EXPECT_EQ(Error::TooManyVotingNodes, e.unwrapErr());
+
+    /* a caught up non-voting node isn't promoted while the slots are taken */
+    Index idx = storage.get_current_idx();
+    EXPECT_TRUE(r.accept_rep(NodeId(65), MsgAppendEntriesRep(r.get_current_term(), true, idx)).isNone());
+    EXPECT_EQ(idx, storage.get_current_idx());
+    EXPECT_FALSE(r.nodes().get_node(NodeId(65))->is_voting());
+}